@@ -20,12 +20,17 @@
  */
 
 #include "brs-writer.h"
+#include "snapshot.h"
 
+#include <algorithm>
 #include <cctype>
 #include <cinttypes>
+#include <cstring>
+#include <functional>
 #include <map>
 #include <set>
 #include <iostream>
+#include <iterator>
 #include <regex>
 
 #include "src/cast.h"
@@ -120,6 +125,77 @@ struct StackVar {
   Type type;
 };
 
+// Reads a value from the stack, writing the value itself when it is a constant
+// or extension that has not been assigned to its stack variable yet.
+struct StackValue {
+  explicit StackValue(Index index) : index(index) {}
+  Index index;
+};
+
+// What we know about each value on the type stack at translation time.
+struct StackValueInfo {
+  bool is_const = false;
+  // The value was never written to the stack variable (only the literal or the
+  // extension is valid).
+  bool pending = false;
+  Const value = Const::I32(0);
+  // The I64 value is the sign extension of the I32 stack variable in the same
+  // position.
+  bool sign_extended = false;
+  // The value is known to be below 2^max_bits when viewed as unsigned. Bounds
+  // are only kept while they are narrower than the type, so a known bound also
+  // means the sign bit is clear (signed and unsigned views agree).
+  Index max_bits = 64;
+};
+
+// A value in one iteration of a loop recognized by WriteLoopIdiom: the sum of
+// some locals (as they were when the iteration began) and a constant, or a
+// byte loaded from such an address, or a comparison of two sums.
+struct AffineValue {
+  std::vector<Index> locals;
+  int64_t offset = 0;
+};
+
+struct IdiomValue {
+  enum class Kind { Affine, Load, Compare } kind = Kind::Affine;
+  AffineValue value;
+  AffineValue rhs;
+  Opcode opcode = Opcode::Nop;
+};
+
+// A value on the stack while looking for shadow stack slots that can live in
+// locals: the stack pointer, a new frame (the stack pointer minus a constant),
+// or the frame local plus an offset.
+struct FrameValue {
+  enum class Kind { Other, Const, StackPointer, NewFrame, Frame } kind = Kind::Other;
+  uint32_t value = 0;
+};
+
+// A load or store at a constant offset in the frame.
+struct FrameAccess {
+  const Expr* expr;
+  uint32_t address;
+  Type type;
+  uint32_t size;
+  // Loads and stores of the whole value, with no extension or wrapping.
+  bool exact;
+};
+
+struct FrameWalk {
+  Index stack_pointer = kInvalidIndex;
+  Index frame_local = kInvalidIndex;
+  std::set<Index> read_locals;
+  std::vector<FrameAccess> accesses;
+};
+
+// A copy of a function with some parameters fixed to constants, which is
+// called instead wherever those constants are passed.
+struct Specialization {
+  // The key of its global name.
+  std::string name;
+  std::map<Index, Const> params;
+};
+
 struct TypeEnum {
   explicit TypeEnum(Type type) : type(type) {}
   Type type;
@@ -147,6 +223,9 @@ int GetShiftMask(Type type) {
   }
 }
 
+struct Intrinsic;
+struct MathIntrinsic;
+
 class CWriter {
  public:
   CWriter(const WriteCOptions& options)
@@ -155,6 +234,7 @@ class CWriter {
   }
 
   std::string GetFilename(size_t index);
+  std::string GetSidecarFilename(const char* extension);
   FileStream OpenFileStream(size_t index);
   void WriteModule(const Module&);
 
@@ -171,6 +251,26 @@ class CWriter {
   void PushTypes(const TypeVector&);
   void DropTypes(size_t count);
 
+  StackValueInfo& StackInfo(Index);
+  bool IsPending(Index);
+  const Const* GetStackConst(Index);
+  void PushConst(const Const&);
+  void FlushPendingValues();
+  void DiscardPendingValues();
+  bool TryFoldExpr(const Expr&);
+  void CollectReadLocals(const ExprList&);
+  std::set<Index> CollectUninitializedReads(const ExprList&, std::set<Index> assigned);
+  bool UsesMemory(const Func&) const;
+  bool IsDeadLocal(const Var&) const;
+  void SetLocalInfo(const Var&, Index stack_index);
+  bool IsNonNegative(Index);
+  void ComputeLocalMaxBits(const Func&);
+  bool WalkLocalMaxBits(const ExprList&, std::vector<StackValueInfo>* stack, size_t pass, bool* changed);
+  Index FindStackPointer() const;
+  bool HasFrameStackPointerWrites(const Func&, Index stack_pointer, bool* has_frame) const;
+  void FindFrameSlots(const Func&);
+  bool WalkFrameSlots(const ExprList&, std::vector<FrameValue>* stack, FrameWalk*);
+
   void PushLabel(LabelType,
                  const std::string& name,
                  const FuncSignature&,
@@ -228,6 +328,7 @@ class CWriter {
   void WriteLabelRaw(const LabelDecl&);
   void Write(const GlobalVar&);
   void Write(const StackVar&);
+  void Write(const StackValue&);
   void Write(const ResultType&);
   void Write(const Const&);
   void WriteInitExpr(const ExprList&);
@@ -244,12 +345,34 @@ class CWriter {
   void DefineTables();
   void WriteTable(const std::string&);
   void WriteDataInitializers();
+  bool AnyPassiveDataSegments() const;
   void WriteElemInitializers();
   void WriteInitExports();
   void WriteExports();
   void WriteInit();
+  void WriteSnapshotFunctions();
+  const MathIntrinsic* FindMathIntrinsic(const Func&) const;
+  void MarkReachableFuncs(std::vector<Index> roots, std::vector<bool>* reachable);
+  void ComputeReachableFuncs();
+  void ComputeResultArrays();
+  bool ReturnsResultArray(const Func&) const;
+  void WriteResultSlot(Index);
+  void ComputeGlobalEffects();
+  void ComputeTableEntries();
+  void ComputeSpecializations();
+  const Specialization* FindSpecialization(Index func_index, Index num_params);
+  const Const* GetSpecializedParam(Index) const;
+  void DefineGlobalCaches(const Func&);
+  void WriteGlobalCacheStores(const std::vector<bool>* accessed);
+  void WriteGlobalCacheLoads(const std::vector<bool>& written, bool restores_stack_pointer);
+  const Func* GetFoldedFunc(Index func_index) const;
   void WriteFuncs();
+  void WriteLazyFunc(const Func&, std::string code);
+  void WriteLazyLoader();
+  void WriteLazyGroups();
+  std::string GetLazyGroupFilename(size_t group);
   void Write(const Func&);
+  void WriteReplacedFunc(const Func&, const Intrinsic*, const MathIntrinsic*);
   void WriteParams(const std::vector<std::string>& index_to_name);
   void WriteLocals(const std::vector<std::string>& index_to_name);
   void WriteStackVarDeclarations();
@@ -265,9 +388,27 @@ class CWriter {
                             const char* op,
                             AssignOp = AssignOp::Disallowed);
   void WritePrefixBinaryExpr(Opcode, const char* op);
+  void WriteShiftExpr(Opcode, const char* op);
+  void WriteI64DivRemUExpr(Opcode, bool remainder);
+  void WriteConstShrSExpr(Opcode);
+  void WriteConstRotateExpr(Opcode, bool left);
+  bool WriteConstDivRemUExpr(Opcode, bool remainder);
   void WriteExprReplacement(Opcode opcode, size_t args, size_t offset, const std::string& input);
   void WriteCompareExpr(Opcode, const char* op);
   void WriteCompareI32UExpr(Opcode, const char* op);
+  void WriteCompareI64UExpr(Opcode, const char* op, const char* func);
+  void WriteNarrowUnaryExpr(Opcode, const char* func, Index max_bits);
+  void WriteCall(const Var&);
+  void WriteCallIndirect(const FuncDeclaration&);
+  bool IsSelfTailCall(ExprList::const_iterator, const ExprList&) const;
+  bool HasSelfTailCall(const ExprList&) const;
+  bool PassesSpecializedParams();
+  void WriteSelfTailCall();
+  void WriteReturn();
+  bool WriteWideningMulShift(ExprList::const_iterator, ExprList::const_iterator end);
+  void WriteMemoryAddress(Index, uint32_t offset);
+  bool WriteLoopIdiom(const Block&);
+  bool WriteUnrolledMemoryOp(bool fill, bool may_overlap);
   void WriteEqzExpr(Opcode);
   void Write(const BinaryExpr&);
   void Write(const CompareExpr&);
@@ -284,6 +425,10 @@ class CWriter {
   const Module* module_ = nullptr;
   const Func* func_ = nullptr;
   size_t label_count_ = 0;
+  // Counters for the short names given out by --minify, and what they were.
+  size_t minified_global_count_ = 0;
+  size_t minified_local_count_ = 0;
+  std::vector<std::pair<std::string, std::string>> minified_names_;
   MemoryStream stream_;
   std::vector<std::string> chunks_;
   int indent_ = 0;
@@ -296,10 +441,65 @@ class CWriter {
   SymbolSet local_syms_;
   SymbolSet import_syms_;
   TypeVector type_stack_;
+  std::vector<StackValueInfo> stack_info_;
   std::vector<Label> label_stack_;
+  // What we know about locals at the current point of the function.
+  std::map<Index, StackValueInfo> local_info_;
+  std::set<Index> read_locals_;
+  std::set<Index> uninitialized_reads_;
+  // Upper bound on the bits of every value ever stored to each local.
+  std::vector<Index> local_max_bits_;
+  // Functions that can be called from exports, starts, the table or --keep.
+  std::vector<bool> reachable_funcs_;
+  // Functions referred to by name rather than only called: exports, table
+  // entries and ref.func.
+  std::vector<bool> named_funcs_;
+  // Functions with several results that return them in an array, since the
+  // host calls or implements them. The rest return the first result and
+  // leave the others in module level slots.
+  std::vector<bool> result_array_funcs_;
+  // Whether call_indirect gets several results in an array.
+  bool table_result_arrays_ = false;
+  // The globals each function (including what it calls) may read or write,
+  // and may write, indexed by function and then global. The table_ versions
+  // cover every function that call_indirect may reach.
+  std::vector<std::vector<bool>> func_global_accesses_;
+  std::vector<std::vector<bool>> func_global_writes_;
+  std::vector<bool> table_global_accesses_;
+  std::vector<bool> table_global_writes_;
+  // Whether each function (and call_indirect) always leaves the stack
+  // pointer as it found it.
+  std::vector<bool> stack_pointer_restoring_funcs_;
+  bool table_restores_stack_pointer_ = false;
+  // The function index of each table entry (kInvalidIndex when unset), and
+  // whether that's all of the table, so call_indirect targets can be known.
+  std::vector<Index> table_entries_;
+  bool table_known_ = false;
+  // The specializations of each function, and the one being written.
+  std::vector<std::vector<Specialization>> specializations_;
+  const Specialization* specialization_ = nullptr;
+  // A local holding the table, in functions with several call_indirects.
+  std::string table_local_;
+  // Frame slots of the current function kept in locals, by the loads and
+  // stores that use them, and the names of those locals.
+  std::map<const Expr*, Index> frame_slot_exprs_;
+  std::vector<std::string> frame_slots_;
+  // Locals caching globals in the current function, and the globals it sets.
+  std::map<Index, std::string> global_caches_;
+  std::set<Index> dirty_global_caches_;
+  // The function whose code is written in place of each identical function.
+  std::vector<Index> folded_funcs_;
+  // With --lazy, the functions compiled at launch, whether the one being
+  // written isn't, and the code and names of the cold functions in each
+  // script that is loaded on first use.
+  std::vector<bool> hot_funcs_;
+  bool cold_func_ = false;
+  std::vector<std::string> lazy_groups_;
+  std::vector<std::vector<std::string>> lazy_group_funcs_;
 };
 
 static const char kImplicitFuncLabel[] = "$Bfunc";
+static const char kFuncEntryLabel[] = "$Bentry";
 
 #define SECTION_NAME(x) s_header_##x
 #include "src/prebuilt/wasm2c.include.h"
@@ -309,206 +509,1226 @@ static const char kImplicitFuncLabel[] = "$Bfunc";
 #include "src/prebuilt/wasm2c.include.c"
 #undef SECTION_NAME
 
-static bool IsReplaceableMemFunction(const wabt::Func& func) {
-  return
-    (func.name == "$memcpy" || func.name == "$memset") &&
-    func.GetNumParams() == 3 &&
-    func.GetParamType(0) == wabt::Type::I32 &&
-    func.GetParamType(1) == wabt::Type::I32 &&
-    func.GetParamType(2) == wabt::Type::I32 &&
-    func.GetNumResults() == 1 &&
-    func.GetResultType(0) == wabt::Type::I32;
+// Calls the callback on every expression, including those nested in blocks.
+template <typename F>
+void ForEachExpr(const ExprList& exprs, F&& callback) {
+  for (const Expr& expr : exprs) {
+    callback(expr);
+    switch (expr.type()) {
+      case ExprType::Block:
+        ForEachExpr(cast<BlockExpr>(&expr)->block.exprs, callback);
+        break;
+      case ExprType::Loop:
+        ForEachExpr(cast<LoopExpr>(&expr)->block.exprs, callback);
+        break;
+      case ExprType::If: {
+        const IfExpr* if_ = cast<IfExpr>(&expr);
+        ForEachExpr(if_->true_.exprs, callback);
+        ForEachExpr(if_->false_, callback);
+        break;
+      }
+      default:
+        break;
+    }
+  }
 }
 
-size_t CWriter::MarkTypeStack() const {
-  return type_stack_.size();
-}
+// libc routines that are replaced by a call to a runtime.brs function taking
+// the memory as its first argument. All parameters and results are i32.
+struct Intrinsic {
+  const char* name;
+  const char* runtime_name;
+  Index num_params;
+  bool writes_memory;
+};
 
-void CWriter::ResetTypeStack(size_t mark) {
-  assert(mark <= type_stack_.size());
-  type_stack_.erase(type_stack_.begin() + mark, type_stack_.end());
-}
+static const Intrinsic s_intrinsics[] = {
+  {"$memcpy", "MemCpy", 3, true},
+  {"$memmove", "MemMove", 3, true},
+  {"$memset", "MemSet", 3, true},
+  {"$strncpy", "StrNCpy", 3, true},
+  {"$memcmp", "MemCmp", 3, false},
+  {"$memchr", "MemChr", 3, false},
+  {"$strlen", "StrLen", 1, false},
+  {"$strcmp", "StrCmp", 2, false},
+};
 
-Type CWriter::StackType(Index index) const {
-  assert(index < type_stack_.size());
-  return *(type_stack_.rbegin() + index);
+// Checks the shape of a body that claims to be an intrinsic, so an unrelated
+// function that happens to share the name isn't replaced. It must loop over
+// memory, may only store if the routine does, and has no other side effects.
+static bool MatchesIntrinsicBody(const Module& module, const Func& func, const Intrinsic& intrinsic, bool is_callee = false) {
+  bool loops = false;
+  bool loads = false;
+  bool stores = false;
+  bool other_effects = false;
+  ForEachExpr(func.exprs, [&](const Expr& expr) {
+    switch (expr.type()) {
+      case ExprType::Loop:
+        loops = true;
+        break;
+      case ExprType::Load:
+        loads = true;
+        break;
+      case ExprType::Store:
+        stores = true;
+        break;
+      case ExprType::MemoryCopy:
+      case ExprType::MemoryFill:
+        loops = true;
+        loads |= expr.type() == ExprType::MemoryCopy;
+        stores = true;
+        break;
+      case ExprType::Call:
+        // Helpers (e.g. strncpy calling stpncpy) are fine if they are plain.
+        other_effects |= is_callee ||
+            !MatchesIntrinsicBody(module, *module.GetFunc(cast<CallExpr>(&expr)->var), intrinsic, true);
+        break;
+      case ExprType::CallIndirect:
+      case ExprType::ReturnCall:
+      case ExprType::ReturnCallIndirect:
+      case ExprType::GlobalSet:
+      case ExprType::MemoryGrow:
+        other_effects = true;
+        break;
+      default:
+        break;
+    }
+  });
+  if (is_callee) {
+    return !other_effects && (intrinsic.writes_memory || !stores);
+  }
+  return loops && !other_effects && (intrinsic.writes_memory ? stores : loads && !stores);
 }
 
-void CWriter::PushType(Type type) {
-  type_stack_.push_back(type);
+static const Intrinsic* FindIntrinsic(const Module& module, const Func& func) {
+  for (const Intrinsic& intrinsic : s_intrinsics) {
+    if (func.name != intrinsic.name || func.GetNumParams() != intrinsic.num_params ||
+        func.GetNumResults() != 1 || func.GetResultType(0) != Type::I32) {
+      continue;
+    }
+    for (Index i = 0; i < func.GetNumParams(); ++i) {
+      if (func.GetParamType(i) != Type::I32) {
+        return nullptr;
+      }
+    }
+    return MatchesIntrinsicBody(module, func, intrinsic) ? &intrinsic : nullptr;
+  }
+  return nullptr;
 }
 
-void CWriter::PushTypes(const TypeVector& types) {
-  type_stack_.insert(type_stack_.end(), types.begin(), types.end());
+// libm routines that are replaced by native math when --native-math allows.
+// The natives work in single precision, so only the exact ones are used for
+// doubles unless all precision may be traded for speed.
+struct MathIntrinsic {
+  const char* name;
+  Type type;
+  Index num_params;
+  const char* prefix;
+  const char* separator;
+  const char* suffix;
+  bool exact;
+};
+
+static const MathIntrinsic s_math_intrinsics[] = {
+  {"$sinf", Type::F32, 1, "Sin(", "", ")", false},
+  {"$cosf", Type::F32, 1, "Cos(", "", ")", false},
+  {"$tanf", Type::F32, 1, "Tan(", "", ")", false},
+  {"$atanf", Type::F32, 1, "Atn(", "", ")", false},
+  {"$expf", Type::F32, 1, "Exp(", "", ")", false},
+  {"$logf", Type::F32, 1, "Log(", "", ")", false},
+  {"$powf", Type::F32, 2, "(", " ^ ", ")", false},
+  {"$sqrtf", Type::F32, 1, "Sqr(", "", ")", true},
+  {"$fabsf", Type::F32, 1, "Abs(", "", ")", true},
+  {"$sin", Type::F64, 1, "Sin(", "", ")", false},
+  {"$cos", Type::F64, 1, "Cos(", "", ")", false},
+  {"$tan", Type::F64, 1, "Tan(", "", ")", false},
+  {"$atan", Type::F64, 1, "Atn(", "", ")", false},
+  {"$exp", Type::F64, 1, "Exp(", "", ")", false},
+  {"$log", Type::F64, 1, "Log(", "", ")", false},
+  {"$pow", Type::F64, 2, "(", " ^ ", ")", false},
+  {"$sqrt", Type::F64, 1, "F64Sqrt(", "", ")", true},
+  {"$fabs", Type::F64, 1, "F64Abs(", "", ")", true},
+};
+
+int CountLeadingZeros(uint64_t value, int bits) {
+  int count = 0;
+  while (count < bits && ((value >> (bits - 1 - count)) & 1) == 0) {
+    ++count;
+  }
+  return count;
 }
 
-void CWriter::DropTypes(size_t count) {
-  assert(count <= type_stack_.size());
-  type_stack_.erase(type_stack_.end() - count, type_stack_.end());
+int CountTrailingZeros(uint64_t value, int bits) {
+  int count = 0;
+  while (count < bits && ((value >> count) & 1) == 0) {
+    ++count;
+  }
+  return count;
 }
 
-void CWriter::PushLabel(LabelType label_type,
-                        const std::string& name,
-                        const FuncSignature& sig,
-                        bool used) {
-  // TODO(binji): Add multi-value support.
-  if ((label_type != LabelType::Func && sig.GetNumParams() != 0)) {
-    BRS_ABORT("Unsupported multiple values: label_type " << (int)label_type << ", params " << sig.GetNumParams());
+int CountOnes(uint64_t value) {
+  int count = 0;
+  for (; value != 0; value &= value - 1) {
+    ++count;
   }
+  return count;
+}
 
-  label_stack_.emplace_back(label_type, name, sig.result_types,
-                            type_stack_.size(), used);
+// Evaluate integer operations at translation time with wasm semantics.
+// Returns false for anything that would trap, so that it still traps at runtime.
+bool EvaluateUnaryConst(Opcode opcode, const Const& in, Const* out) {
+  const uint32_t a32 = in.u32();
+  const uint64_t a64 = in.u64();
+  switch (opcode) {
+    case Opcode::I32Eqz: *out = Const::I32(a32 == 0); return true;
+    case Opcode::I64Eqz: *out = Const::I32(a64 == 0); return true;
+    case Opcode::I32WrapI64: *out = Const::I32(static_cast<uint32_t>(a64)); return true;
+    case Opcode::I64ExtendI32U: *out = Const::I64(a32); return true;
+    case Opcode::I64ExtendI32S:
+      *out = Const::I64(static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(a32))));
+      return true;
+    case Opcode::I32Clz: *out = Const::I32(CountLeadingZeros(a32, 32)); return true;
+    case Opcode::I64Clz: *out = Const::I64(CountLeadingZeros(a64, 64)); return true;
+    case Opcode::I32Ctz: *out = Const::I32(CountTrailingZeros(a32, 32)); return true;
+    case Opcode::I64Ctz: *out = Const::I64(CountTrailingZeros(a64, 64)); return true;
+    case Opcode::I32Popcnt: *out = Const::I32(CountOnes(a32)); return true;
+    case Opcode::I64Popcnt: *out = Const::I64(CountOnes(a64)); return true;
+    case Opcode::I32Extend8S:
+      *out = Const::I32(static_cast<uint32_t>(static_cast<int32_t>(static_cast<int8_t>(a32))));
+      return true;
+    case Opcode::I32Extend16S:
+      *out = Const::I32(static_cast<uint32_t>(static_cast<int32_t>(static_cast<int16_t>(a32))));
+      return true;
+    case Opcode::I64Extend8S:
+      *out = Const::I64(static_cast<uint64_t>(static_cast<int64_t>(static_cast<int8_t>(a64))));
+      return true;
+    case Opcode::I64Extend16S:
+      *out = Const::I64(static_cast<uint64_t>(static_cast<int64_t>(static_cast<int16_t>(a64))));
+      return true;
+    case Opcode::I64Extend32S:
+      *out = Const::I64(static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(a64))));
+      return true;
+    default:
+      return false;
+  }
 }
 
-const Label* CWriter::FindLabel(const Var& var) {
-  Label* label = nullptr;
+bool EvaluateBinaryConst(Opcode opcode, const Const& lhs, const Const& rhs, Const* out) {
+  const uint32_t l32 = lhs.u32();
+  const uint32_t r32 = rhs.u32();
+  const int32_t ls32 = static_cast<int32_t>(l32);
+  const int32_t rs32 = static_cast<int32_t>(r32);
+  const uint64_t l64 = lhs.u64();
+  const uint64_t r64 = rhs.u64();
+  const int64_t ls64 = static_cast<int64_t>(l64);
+  const int64_t rs64 = static_cast<int64_t>(r64);
+  const uint32_t k32 = r32 & 31;
+  const uint64_t k64 = r64 & 63;
+  switch (opcode) {
+    case Opcode::I32Add: *out = Const::I32(l32 + r32); return true;
+    case Opcode::I32Sub: *out = Const::I32(l32 - r32); return true;
+    case Opcode::I32Mul: *out = Const::I32(l32 * r32); return true;
+    case Opcode::I32DivS:
+      if (r32 == 0 || (ls32 == INT32_MIN && rs32 == -1)) return false;
+      *out = Const::I32(static_cast<uint32_t>(ls32 / rs32));
+      return true;
+    case Opcode::I32DivU:
+      if (r32 == 0) return false;
+      *out = Const::I32(l32 / r32);
+      return true;
+    case Opcode::I32RemS:
+      if (r32 == 0) return false;
+      *out = Const::I32(rs32 == -1 ? 0 : static_cast<uint32_t>(ls32 % rs32));
+      return true;
+    case Opcode::I32RemU:
+      if (r32 == 0) return false;
+      *out = Const::I32(l32 % r32);
+      return true;
+    case Opcode::I32And: *out = Const::I32(l32 & r32); return true;
+    case Opcode::I32Or: *out = Const::I32(l32 | r32); return true;
+    case Opcode::I32Xor: *out = Const::I32(l32 ^ r32); return true;
+    case Opcode::I32Shl: *out = Const::I32(l32 << k32); return true;
+    case Opcode::I32ShrS: *out = Const::I32(static_cast<uint32_t>(ls32 >> k32)); return true;
+    case Opcode::I32ShrU: *out = Const::I32(l32 >> k32); return true;
+    case Opcode::I32Rotl:
+      *out = Const::I32(k32 == 0 ? l32 : (l32 << k32) | (l32 >> (32 - k32)));
+      return true;
+    case Opcode::I32Rotr:
+      *out = Const::I32(k32 == 0 ? l32 : (l32 >> k32) | (l32 << (32 - k32)));
+      return true;
 
-  if (var.is_index()) {
-    // We've generated names for all labels, so we should only be using an
-    // index when branching to the implicit function label, which can't be
-    // named.
-    assert(var.index() + 1 == label_stack_.size());
-    label = &label_stack_[0];
-  } else {
-    assert(var.is_name());
-    for (Index i = label_stack_.size(); i > 0; --i) {
-      label = &label_stack_[i - 1];
-      if (label->name == var.name())
-        break;
-    }
-  }
+    case Opcode::I64Add: *out = Const::I64(l64 + r64); return true;
+    case Opcode::I64Sub: *out = Const::I64(l64 - r64); return true;
+    case Opcode::I64Mul: *out = Const::I64(l64 * r64); return true;
+    case Opcode::I64DivS:
+      if (r64 == 0 || (ls64 == INT64_MIN && rs64 == -1)) return false;
+      *out = Const::I64(static_cast<uint64_t>(ls64 / rs64));
+      return true;
+    case Opcode::I64DivU:
+      if (r64 == 0) return false;
+      *out = Const::I64(l64 / r64);
+      return true;
+    case Opcode::I64RemS:
+      if (r64 == 0) return false;
+      *out = Const::I64(rs64 == -1 ? 0 : static_cast<uint64_t>(ls64 % rs64));
+      return true;
+    case Opcode::I64RemU:
+      if (r64 == 0) return false;
+      *out = Const::I64(l64 % r64);
+      return true;
+    case Opcode::I64And: *out = Const::I64(l64 & r64); return true;
+    case Opcode::I64Or: *out = Const::I64(l64 | r64); return true;
+    case Opcode::I64Xor: *out = Const::I64(l64 ^ r64); return true;
+    case Opcode::I64Shl: *out = Const::I64(l64 << k64); return true;
+    case Opcode::I64ShrS: *out = Const::I64(static_cast<uint64_t>(ls64 >> k64)); return true;
+    case Opcode::I64ShrU: *out = Const::I64(l64 >> k64); return true;
+    case Opcode::I64Rotl:
+      *out = Const::I64(k64 == 0 ? l64 : (l64 << k64) | (l64 >> (64 - k64)));
+      return true;
+    case Opcode::I64Rotr:
+      *out = Const::I64(k64 == 0 ? l64 : (l64 >> k64) | (l64 << (64 - k64)));
+      return true;
+
+    case Opcode::I32Eq: *out = Const::I32(l32 == r32); return true;
+    case Opcode::I32Ne: *out = Const::I32(l32 != r32); return true;
+    case Opcode::I32LtS: *out = Const::I32(ls32 < rs32); return true;
+    case Opcode::I32LtU: *out = Const::I32(l32 < r32); return true;
+    case Opcode::I32GtS: *out = Const::I32(ls32 > rs32); return true;
+    case Opcode::I32GtU: *out = Const::I32(l32 > r32); return true;
+    case Opcode::I32LeS: *out = Const::I32(ls32 <= rs32); return true;
+    case Opcode::I32LeU: *out = Const::I32(l32 <= r32); return true;
+    case Opcode::I32GeS: *out = Const::I32(ls32 >= rs32); return true;
+    case Opcode::I32GeU: *out = Const::I32(l32 >= r32); return true;
+    case Opcode::I64Eq: *out = Const::I32(l64 == r64); return true;
+    case Opcode::I64Ne: *out = Const::I32(l64 != r64); return true;
+    case Opcode::I64LtS: *out = Const::I32(ls64 < rs64); return true;
+    case Opcode::I64LtU: *out = Const::I32(l64 < r64); return true;
+    case Opcode::I64GtS: *out = Const::I32(ls64 > rs64); return true;
+    case Opcode::I64GtU: *out = Const::I32(l64 > r64); return true;
+    case Opcode::I64LeS: *out = Const::I32(ls64 <= rs64); return true;
+    case Opcode::I64LeU: *out = Const::I32(l64 <= r64); return true;
+    case Opcode::I64GeS: *out = Const::I32(ls64 >= rs64); return true;
+    case Opcode::I64GeU: *out = Const::I32(l64 >= r64); return true;
 
-  assert(label);
-  label->used = true;
-  return label;
+    default:
+      return false;
+  }
 }
 
-bool CWriter::IsTopLabelUsed() const {
-  assert(!label_stack_.empty());
-  return label_stack_.back().used;
-}
+const Index kUnknownBits = 64;
 
-void CWriter::PopLabel() {
-  label_stack_.pop_back();
+Index GetTypeBits(Type type) {
+  return type == Type::I64 ? 64 : 32;
 }
 
-// static
-std::string CWriter::AddressOf(const std::string& s) {
-  return s;
+// Bounds are only worth keeping while they leave the sign bit clear.
+Index NormalizeMaxBits(Index bits, Type type) {
+  return bits < GetTypeBits(type) ? bits : kUnknownBits;
 }
 
-// static
-std::string CWriter::Deref(const std::string& s) {
-  return s;
+Index GetConstMaxBits(const Const& const_) {
+  switch (const_.type()) {
+    case Type::I32: return NormalizeMaxBits(32 - CountLeadingZeros(const_.u32(), 32), Type::I32);
+    case Type::I64: return NormalizeMaxBits(64 - CountLeadingZeros(const_.u64(), 64), Type::I64);
+    default: return kUnknownBits;
+  }
 }
 
-// static
-char CWriter::MangleType(Type type) {
-  switch (type) {
-    case Type::I32: return 'i';
-    case Type::I64: return 'j';
-    case Type::F32: return 'f';
-    case Type::F64: return 'd';
+// Bounds the result of an expression from the bounds of its operands, where
+// operand(0) is the top of the stack. Returns kUnknownBits when the result
+// may have the sign bit set, or for expressions we don't reason about.
+template <typename F>
+Index GetResultMaxBits(const Expr& expr, F&& operand) {
+  switch (expr.type()) {
+    case ExprType::Binary: {
+      const Opcode opcode = cast<BinaryExpr>(&expr)->opcode;
+      const Type type = opcode.GetResultType();
+      const Index width = GetTypeBits(type);
+      const Index lhs = std::min(operand(1).max_bits, width);
+      const Index rhs = std::min(operand(0).max_bits, width);
+      const Const* amount = operand(0).is_const ? &operand(0).value : nullptr;
+      Index bits = kUnknownBits;
+      switch (opcode) {
+        case Opcode::I32And:
+        case Opcode::I64And:
+          bits = std::min(lhs, rhs);
+          break;
+        case Opcode::I32Or:
+        case Opcode::I64Or:
+        case Opcode::I32Xor:
+        case Opcode::I64Xor:
+          bits = std::max(lhs, rhs);
+          break;
+        case Opcode::I32Add:
+        case Opcode::I64Add:
+          bits = std::max(lhs, rhs) + 1;
+          break;
+        case Opcode::I32Mul:
+        case Opcode::I64Mul:
+          bits = lhs + rhs;
+          break;
+        case Opcode::I32DivU:
+        case Opcode::I64DivU:
+          bits = lhs;
+          if (amount) {
+            const uint64_t divisor = type == Type::I32 ? amount->u32() : amount->u64();
+            if (divisor != 0) {
+              bits -= std::min(lhs, Index(63 - CountLeadingZeros(divisor, 64)));
+            }
+          }
+          break;
+        case Opcode::I32RemU:
+        case Opcode::I64RemU:
+          bits = std::min(lhs, rhs);
+          break;
+        case Opcode::I32DivS:
+        case Opcode::I64DivS:
+          bits = lhs < width && rhs < width ? lhs : kUnknownBits;
+          break;
+        case Opcode::I32RemS:
+        case Opcode::I64RemS:
+          bits = lhs < width ? std::min(lhs, rhs) : kUnknownBits;
+          break;
+        case Opcode::I32ShrS:
+        case Opcode::I64ShrS:
+          if (lhs >= width) {
+            break;
+          }
+          // Same as a logical shift when the sign bit is clear.
+          // Fall through.
+        case Opcode::I32ShrU:
+        case Opcode::I64ShrU:
+          bits = amount ? lhs - std::min(lhs, Index(amount->u32() & GetShiftMask(type))) : lhs;
+          break;
+        case Opcode::I32Shl:
+        case Opcode::I64Shl:
+          bits = amount ? lhs + (amount->u32() & GetShiftMask(type)) : kUnknownBits;
+          break;
+        default:
+          break;
+      }
+      return NormalizeMaxBits(bits, type);
+    }
+
+    case ExprType::Compare:
+      return 1;
+
+    case ExprType::Convert: {
+      const Opcode opcode = cast<ConvertExpr>(&expr)->opcode;
+      const Index in = operand(0).max_bits;
+      switch (opcode) {
+        case Opcode::I32Eqz:
+        case Opcode::I64Eqz:
+          return 1;
+        case Opcode::I64ExtendI32U:
+          return std::min(in, Index(32));
+        case Opcode::I64ExtendI32S:
+          return in;
+        case Opcode::I32WrapI64:
+          return NormalizeMaxBits(in, Type::I32);
+        default:
+          return kUnknownBits;
+      }
+    }
+
+    case ExprType::Unary: {
+      const Index in = operand(0).max_bits;
+      switch (cast<UnaryExpr>(&expr)->opcode) {
+        case Opcode::I32Clz:
+        case Opcode::I64Clz:
+        case Opcode::I32Ctz:
+        case Opcode::I64Ctz:
+        case Opcode::I32Popcnt:
+        case Opcode::I64Popcnt:
+          return 7;
+        // Sign extensions don't change values that already fit.
+        case Opcode::I32Extend8S:
+        case Opcode::I64Extend8S:
+          return in <= 7 ? in : kUnknownBits;
+        case Opcode::I32Extend16S:
+        case Opcode::I64Extend16S:
+          return in <= 15 ? in : kUnknownBits;
+        case Opcode::I64Extend32S:
+          return in <= 31 ? in : kUnknownBits;
+        default:
+          return kUnknownBits;
+      }
+    }
+
+    case ExprType::Load:
+      switch (cast<LoadExpr>(&expr)->opcode) {
+        case Opcode::I32Load8U:
+        case Opcode::I64Load8U:
+          return 8;
+        case Opcode::I32Load16U:
+        case Opcode::I64Load16U:
+          return 16;
+        case Opcode::I64Load32U:
+          return 32;
+        default:
+          return kUnknownBits;
+      }
+
+    case ExprType::MemorySize:
+      // At most 65536 pages.
+      return 17;
+
+    case ExprType::Select:
+      return std::max(operand(1).max_bits, operand(2).max_bits);
+
     default:
-      BRS_UNREACHABLE;
-      return '_';
+      return kUnknownBits;
   }
 }
 
-std::string CWriter::LegalizeNameNoAddons(string_view name) {
-  std::string result;
-  for (size_t i = 0; i < name.size(); ++i)
-    result += isalnum(name[i]) ? tolower(name[i]) : '_';
-  return result;
-}
-
-uint32_t adler32(const uint8_t* data, size_t len) {
-  const uint32_t MOD_ADLER = 65521;
-  uint32_t a = 1, b = 0;
-  for (size_t i = 0; i < len; ++i) {
-    a = (a + data[i]) % MOD_ADLER;
-    b = (b + a) % MOD_ADLER;
+// Data and element segment offsets are usually a single constant.
+bool GetConstOffset(const ExprList& offset, uint32_t* out) {
+  if (offset.size() != 1 || offset.front().type() != ExprType::Const) {
+    return false;
   }
-  return (b << 16) | a;
+  *out = cast<ConstExpr>(&offset.front())->const_.u32();
+  return true;
 }
 
-std::string CWriter::LegalizeName(const std::string& prefix, const std::string& module_name, string_view name) {
-  const std::string legalized = LegalizeNameNoAddons(name);
-  const std::string module_prefix = module_name == "env" ? "" : module_name + "_";
-  const std::string output = prefix + module_prefix + legalized;
-  return legalized == name
-    ? output
-    : output + "_" + std::to_string(adler32((const uint8_t*)name.begin(), name.length()));
+size_t CWriter::MarkTypeStack() const {
+  return type_stack_.size();
 }
 
-std::string CWriter::DefineName(SymbolSet* set, string_view name, const std::string& prefix) {
-  std::string legal = LegalizeName(prefix, options_.name_prefix, name);
-  if (set->find(legal) != set->end()) {
-    std::string base = legal + "_";
-    size_t count = 0;
-    do {
-      legal = base + std::to_string(count++);
-    } while (set->find(legal) != set->end());
-  }
-  set->insert(legal);
-  return legal;
+void CWriter::ResetTypeStack(size_t mark) {
+  assert(mark <= type_stack_.size());
+  type_stack_.erase(type_stack_.begin() + mark, type_stack_.end());
+  stack_info_.erase(stack_info_.begin() + mark, stack_info_.end());
 }
 
-string_view StripLeadingDollar(string_view name) {
-  if (!name.empty() && name[0] == '$') {
-    name.remove_prefix(1);
-  }
-  return name;
+Type CWriter::StackType(Index index) const {
+  assert(index < type_stack_.size());
+  return *(type_stack_.rbegin() + index);
 }
 
-std::string CWriter::DefineImportName(const std::string& name,
-                                      string_view module,
-                                      string_view mangled_field_name) {
-  std::string mangled = mangled_field_name.to_string();
-  import_syms_.insert(name);
-  global_syms_.insert(mangled);
-  global_sym_map_.insert(SymbolMap::value_type(name, mangled));
-  return mangled;
+void CWriter::PushType(Type type) {
+  type_stack_.push_back(type);
+  stack_info_.emplace_back();
 }
 
-std::string CWriter::DefineGlobalScopeName(const std::string& name, const std::string& prefix) {
-  std::string unique = DefineName(&global_syms_, StripLeadingDollar(name), prefix);
-  global_sym_map_.insert(SymbolMap::value_type(name, unique));
-  return unique;
+void CWriter::PushTypes(const TypeVector& types) {
+  type_stack_.insert(type_stack_.end(), types.begin(), types.end());
+  stack_info_.resize(type_stack_.size());
 }
 
-std::string CWriter::DefineLocalScopeName(const std::string& name) {
-  std::string unique = DefineName(&local_syms_, StripLeadingDollar(name));
-  local_sym_map_.insert(SymbolMap::value_type(name, unique));
-  return unique;
+void CWriter::DropTypes(size_t count) {
+  assert(count <= type_stack_.size());
+  type_stack_.erase(type_stack_.end() - count, type_stack_.end());
+  stack_info_.erase(stack_info_.end() - count, stack_info_.end());
 }
 
-std::string CWriter::DefineStackVarName(Index index,
-                                        Type type,
-                                        string_view name) {
-  std::string unique = DefineName(&local_syms_, name);
-  StackTypePair stp = {index, type};
-  stack_var_sym_map_.insert(StackVarSymbolMap::value_type(stp, unique));
-  return unique;
+StackValueInfo& CWriter::StackInfo(Index index) {
+  assert(index < stack_info_.size());
+  return *(stack_info_.rbegin() + index);
 }
 
-void CWriter::EndChunk() {
-  auto buffer = stream_.ReleaseOutputBuffer();
-  chunks_.emplace_back(std::string((const char*)buffer->data.data(), buffer->data.size()));
-  stream_.Clear();
-  stream_.ClearOffset();
+bool CWriter::IsPending(Index index) {
+  return StackInfo(index).pending;
 }
 
-void CWriter::Indent(int size) {
-  indent_ += size;
+const Const* CWriter::GetStackConst(Index index) {
+  const StackValueInfo& info = StackInfo(index);
+  return info.is_const ? &info.value : nullptr;
 }
 
-void CWriter::Dedent(int size) {
-  indent_ -= size;
-  assert(indent_ >= 0);
+// Constants are not written to a stack variable until something needs the
+// variable, so most of them end up inlined as literals into the expression
+// that consumes them (and dropped constants are never written at all).
+void CWriter::PushConst(const Const& const_) {
+  PushType(const_.type());
+  StackValueInfo& info = StackInfo(0);
+  info.is_const = true;
+  info.pending = true;
+  info.value = const_;
+  info.max_bits = GetConstMaxBits(const_);
 }
 
-void CWriter::WriteIndent() {
+void CWriter::FlushPendingValues() {
+  for (Index i = 0; i < stack_info_.size(); ++i) {
+    Index index = stack_info_.size() - 1 - i;
+    StackValueInfo& info = StackInfo(index);
+    if (info.pending && info.sign_extended) {
+      Write(StackVar(index), " = ", StackVar(index, Type::I32), " + 0&", Newline());
+      info.pending = false;
+    } else if (info.pending) {
+      Write(StackVar(index), " = ", info.value, Newline());
+      info.pending = false;
+    }
+  }
+}
+
+// Used after an unconditional branch, where the stack values are never read.
+void CWriter::DiscardPendingValues() {
+  for (StackValueInfo& info : stack_info_) {
+    info.pending = false;
+  }
+}
+
+// Replaces integer operations on constants with their result.
+bool CWriter::TryFoldExpr(const Expr& expr) {
+  Const result = Const::I32();
+  switch (expr.type()) {
+    case ExprType::Binary:
+    case ExprType::Compare: {
+      const Const* lhs = GetStackConst(1);
+      const Const* rhs = lhs ? GetStackConst(0) : nullptr;
+      const Opcode opcode = expr.type() == ExprType::Binary
+        ? cast<BinaryExpr>(&expr)->opcode
+        : cast<CompareExpr>(&expr)->opcode;
+      if (!rhs || !EvaluateBinaryConst(opcode, *lhs, *rhs, &result)) {
+        return false;
+      }
+      DropTypes(2);
+      break;
+    }
+
+    case ExprType::Convert:
+    case ExprType::Unary: {
+      const Const* in = GetStackConst(0);
+      const Opcode opcode = expr.type() == ExprType::Convert
+        ? cast<ConvertExpr>(&expr)->opcode
+        : cast<UnaryExpr>(&expr)->opcode;
+      if (!in || !EvaluateUnaryConst(opcode, *in, &result)) {
+        return false;
+      }
+      DropTypes(1);
+      break;
+    }
+
+    default:
+      return false;
+  }
+
+  PushConst(result);
+  return true;
+}
+
+void CWriter::CollectReadLocals(const ExprList& exprs) {
+  ForEachExpr(exprs, [this](const Expr& expr) {
+    if (expr.type() == ExprType::LocalGet) {
+      read_locals_.insert(func_->GetLocalIndex(cast<LocalGetExpr>(&expr)->var));
+    }
+  });
+}
+
+// Locals (and frame slots, numbered after the locals) that may be read before
+// they are written are added to uninitialized_reads_. Returns the locals that
+// are certainly written whenever the list falls through or branches out.
+std::set<Index> CWriter::CollectUninitializedReads(const ExprList& exprs, std::set<Index> assigned) {
+  const Index num_locals = func_->GetNumParamsAndLocals();
+  std::set<Index> exit_assigned;
+  bool exited = false;
+  auto leave = [&]() {
+    if (!exited) {
+      exit_assigned = assigned;
+      exited = true;
+    }
+  };
+  auto may_branch = [](const ExprList& body) {
+    bool branches = false;
+    ForEachExpr(body, [&](const Expr& expr) {
+      branches |= expr.type() == ExprType::Br || expr.type() == ExprType::BrIf || expr.type() == ExprType::BrTable;
+    });
+    return branches;
+  };
+  auto read = [&](Index index) {
+    if (assigned.count(index) == 0) {
+      uninitialized_reads_.insert(index);
+    }
+  };
+
+  for (const Expr& expr : exprs) {
+    switch (expr.type()) {
+      case ExprType::LocalGet:
+        read(func_->GetLocalIndex(cast<LocalGetExpr>(&expr)->var));
+        break;
+
+      case ExprType::LocalSet:
+        assigned.insert(func_->GetLocalIndex(cast<LocalSetExpr>(&expr)->var));
+        break;
+
+      case ExprType::LocalTee:
+        assigned.insert(func_->GetLocalIndex(cast<LocalTeeExpr>(&expr)->var));
+        break;
+
+      case ExprType::Load:
+      case ExprType::Store: {
+        auto slot = frame_slot_exprs_.find(&expr);
+        if (slot == frame_slot_exprs_.end()) {
+          break;
+        }
+        if (expr.type() == ExprType::Load) {
+          read(num_locals + slot->second);
+        } else {
+          assigned.insert(num_locals + slot->second);
+        }
+        break;
+      }
+
+      case ExprType::Block:
+      case ExprType::Loop: {
+        const ExprList& body = expr.type() == ExprType::Block ? cast<BlockExpr>(&expr)->block.exprs
+                                                              : cast<LoopExpr>(&expr)->block.exprs;
+        if (may_branch(body)) {
+          leave();
+        }
+        assigned = CollectUninitializedReads(body, assigned);
+        break;
+      }
+
+      case ExprType::If: {
+        const IfExpr* if_ = cast<IfExpr>(&expr);
+        if (may_branch(if_->true_.exprs) || may_branch(if_->false_)) {
+          leave();
+        }
+        const std::set<Index> true_assigned = CollectUninitializedReads(if_->true_.exprs, assigned);
+        const std::set<Index> false_assigned = CollectUninitializedReads(if_->false_, assigned);
+        assigned.clear();
+        std::set_intersection(true_assigned.begin(), true_assigned.end(), false_assigned.begin(),
+                              false_assigned.end(), std::inserter(assigned, assigned.end()));
+        break;
+      }
+
+      case ExprType::BrIf:
+        leave();
+        break;
+
+      case ExprType::Br:
+      case ExprType::BrTable:
+        leave();
+        return exit_assigned;
+
+      case ExprType::Return:
+      case ExprType::ReturnCall:
+      case ExprType::ReturnCallIndirect:
+      case ExprType::Unreachable:
+        // The rest of the list is unreachable, and nothing after it runs.
+        return exited ? exit_assigned : assigned;
+
+      default:
+        break;
+    }
+  }
+  return exited ? exit_assigned : assigned;
+}
+
+bool CWriter::UsesMemory(const Func& func) const {
+  bool uses_memory = false;
+  ForEachExpr(func.exprs, [&](const Expr& expr) {
+    switch (expr.type()) {
+      case ExprType::Load:
+      case ExprType::Store:
+        uses_memory |= frame_slot_exprs_.count(&expr) == 0;
+        break;
+      case ExprType::MemorySize:
+      case ExprType::MemoryGrow:
+      case ExprType::MemoryCopy:
+      case ExprType::MemoryFill:
+      case ExprType::MemoryInit:
+      case ExprType::LoadSplat:
+        uses_memory = true;
+        break;
+      case ExprType::Call:
+        // Replaced libc routines take the memory.
+        uses_memory |= FindIntrinsic(*module_, *module_->GetFunc(cast<CallExpr>(&expr)->var)) != nullptr;
+        break;
+      case ExprType::ReturnCall:
+        uses_memory |= FindIntrinsic(*module_, *module_->GetFunc(cast<ReturnCallExpr>(&expr)->var)) != nullptr;
+        break;
+      default:
+        break;
+    }
+  });
+  return uses_memory;
+}
+
+// Stores to locals that are never read can be removed.
+bool CWriter::IsDeadLocal(const Var& var) const {
+  return read_locals_.count(func_->GetLocalIndex(var)) == 0;
+}
+
+void CWriter::SetLocalInfo(const Var& var, Index stack_index) {
+  const Index index = func_->GetLocalIndex(var);
+  StackValueInfo info = StackInfo(stack_index);
+  info.pending = false;
+  local_info_.erase(index);
+  if (info.is_const || info.max_bits != kUnknownBits) {
+    local_info_.emplace(index, info);
+  }
+}
+
+bool CWriter::IsNonNegative(Index index) {
+  return StackInfo(index).max_bits != kUnknownBits;
+}
+
+// Bounds the values stored to each local over the whole function, so that we
+// still know something about them after joins (loops in particular), where the
+// facts tracked while writing are dropped. Locals start at zero and bounds only
+// grow; any that are still growing after the first pass are given up on.
+void CWriter::ComputeLocalMaxBits(const Func& func) {
+  const Index num_params = func.GetNumParams();
+  local_max_bits_.assign(func.GetNumParamsAndLocals(), 0);
+  for (Index i = 0; i < local_max_bits_.size(); ++i) {
+    const Type type = func.GetLocalType(i);
+    if (i < num_params || (type != Type::I32 && type != Type::I64)) {
+      local_max_bits_[i] = kUnknownBits;
+    }
+  }
+
+  const size_t kMaxPasses = 8;
+  for (size_t pass = 0; pass < kMaxPasses; ++pass) {
+    std::vector<StackValueInfo> stack;
+    bool changed = false;
+    if (!WalkLocalMaxBits(func.exprs, &stack, pass, &changed)) {
+      break;
+    }
+    if (!changed) {
+      return;
+    }
+  }
+  local_max_bits_.assign(local_max_bits_.size(), kUnknownBits);
+}
+
+// Returns false for anything the analysis doesn't understand.
+bool CWriter::WalkLocalMaxBits(const ExprList& exprs,
+                               std::vector<StackValueInfo>* stack,
+                               size_t pass,
+                               bool* changed) {
+  auto operand = [stack](Index index) -> const StackValueInfo& {
+    return *(stack->rbegin() + index);
+  };
+  auto pop = [stack](size_t count) {
+    assert(count <= stack->size());
+    stack->resize(stack->size() - count);
+  };
+  auto push_unknown = [stack](size_t count) {
+    stack->resize(stack->size() + count);
+  };
+  auto walk_block = [&](const Block& block, const ExprList& block_exprs) {
+    const size_t mark = stack->size() - block.decl.GetNumParams();
+    const bool result = WalkLocalMaxBits(block_exprs, stack, pass, changed);
+    stack->resize(mark);
+    push_unknown(block.decl.GetNumResults());
+    return result;
+  };
+  auto record = [&](const Var& var, const StackValueInfo& value) {
+    Index& bound = local_max_bits_[func_->GetLocalIndex(var)];
+    if (value.max_bits > bound) {
+      bound = pass == 0 ? value.max_bits : kUnknownBits;
+      *changed = true;
+    }
+  };
+
+  for (const Expr& expr : exprs) {
+    StackValueInfo result;
+    switch (expr.type()) {
+      case ExprType::Binary:
+      case ExprType::Compare: {
+        const Opcode opcode = expr.type() == ExprType::Binary
+          ? cast<BinaryExpr>(&expr)->opcode
+          : cast<CompareExpr>(&expr)->opcode;
+        result.max_bits = GetResultMaxBits(expr, operand);
+        if (operand(0).is_const && operand(1).is_const &&
+            EvaluateBinaryConst(opcode, operand(1).value, operand(0).value, &result.value)) {
+          result.is_const = true;
+          result.max_bits = GetConstMaxBits(result.value);
+        }
+        pop(2);
+        stack->push_back(result);
+        break;
+      }
+
+      case ExprType::Convert:
+      case ExprType::Unary: {
+        const Opcode opcode = expr.type() == ExprType::Convert
+          ? cast<ConvertExpr>(&expr)->opcode
+          : cast<UnaryExpr>(&expr)->opcode;
+        result.max_bits = GetResultMaxBits(expr, operand);
+        if (operand(0).is_const && EvaluateUnaryConst(opcode, operand(0).value, &result.value)) {
+          result.is_const = true;
+          result.max_bits = GetConstMaxBits(result.value);
+        }
+        pop(1);
+        stack->push_back(result);
+        break;
+      }
+
+      case ExprType::Load:
+      case ExprType::Select:
+      case ExprType::MemorySize:
+        result.max_bits = GetResultMaxBits(expr, operand);
+        pop(expr.type() == ExprType::Load ? 1 : expr.type() == ExprType::Select ? 3 : 0);
+        stack->push_back(result);
+        break;
+
+      case ExprType::Const:
+        result.is_const = true;
+        result.value = cast<ConstExpr>(&expr)->const_;
+        result.max_bits = GetConstMaxBits(result.value);
+        stack->push_back(result);
+        break;
+
+      case ExprType::LocalGet:
+        result.max_bits = local_max_bits_[func_->GetLocalIndex(cast<LocalGetExpr>(&expr)->var)];
+        stack->push_back(result);
+        break;
+
+      case ExprType::LocalSet:
+        record(cast<LocalSetExpr>(&expr)->var, operand(0));
+        pop(1);
+        break;
+
+      case ExprType::LocalTee:
+        record(cast<LocalTeeExpr>(&expr)->var, operand(0));
+        break;
+
+      case ExprType::GlobalGet:
+        push_unknown(1);
+        break;
+
+      case ExprType::GlobalSet:
+      case ExprType::Drop:
+      case ExprType::BrIf:
+        pop(1);
+        break;
+
+      case ExprType::Store:
+        pop(2);
+        break;
+
+      case ExprType::MemoryCopy:
+      case ExprType::MemoryFill:
+      case ExprType::MemoryInit:
+        pop(3);
+        break;
+
+      case ExprType::DataDrop:
+        break;
+
+      case ExprType::MemoryGrow:
+      case ExprType::LoadSplat:
+        pop(1);
+        push_unknown(1);
+        break;
+
+      case ExprType::Ternary:
+        pop(3);
+        push_unknown(1);
+        break;
+
+      case ExprType::SimdShuffleOp:
+        pop(2);
+        push_unknown(1);
+        break;
+
+      case ExprType::Call: {
+        const Func* callee = module_->GetFunc(cast<CallExpr>(&expr)->var);
+        pop(callee->GetNumParams());
+        push_unknown(callee->GetNumResults());
+        break;
+      }
+
+      case ExprType::CallIndirect: {
+        const FuncDeclaration& decl = cast<CallIndirectExpr>(&expr)->decl;
+        pop(decl.GetNumParams() + 1);
+        push_unknown(decl.GetNumResults());
+        break;
+      }
+
+      case ExprType::Block: {
+        const Block& block = cast<BlockExpr>(&expr)->block;
+        if (!walk_block(block, block.exprs)) {
+          return false;
+        }
+        break;
+      }
+
+      case ExprType::Loop: {
+        const Block& block = cast<LoopExpr>(&expr)->block;
+        if (!walk_block(block, block.exprs)) {
+          return false;
+        }
+        break;
+      }
+
+      case ExprType::If: {
+        const IfExpr& if_ = *cast<IfExpr>(&expr);
+        pop(1);
+        const std::vector<StackValueInfo> entry = *stack;
+        if (!walk_block(if_.true_, if_.true_.exprs)) {
+          return false;
+        }
+        *stack = entry;
+        if (!walk_block(if_.true_, if_.false_)) {
+          return false;
+        }
+        break;
+      }
+
+      case ExprType::Nop:
+        break;
+
+      case ExprType::Br:
+      case ExprType::BrTable:
+      case ExprType::Return:
+      case ExprType::ReturnCall:
+      case ExprType::ReturnCallIndirect:
+      case ExprType::Unreachable:
+        // The rest of the list is unreachable.
+        return true;
+
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+void CWriter::PushLabel(LabelType label_type,
+                        const std::string& name,
+                        const FuncSignature& sig,
+                        bool used) {
+  // TODO(binji): Add multi-value support.
+  if ((label_type != LabelType::Func && sig.GetNumParams() != 0)) {
+    BRS_ABORT("Unsupported multiple values: label_type " << (int)label_type << ", params " << sig.GetNumParams());
+  }
+
+  label_stack_.emplace_back(label_type, name, sig.result_types,
+                            type_stack_.size(), used);
+}
+
+const Label* CWriter::FindLabel(const Var& var) {
+  Label* label = nullptr;
+
+  if (var.is_index()) {
+    // We've generated names for all labels, so we should only be using an
+    // index when branching to the implicit function label, which can't be
+    // named.
+    assert(var.index() + 1 == label_stack_.size());
+    label = &label_stack_[0];
+  } else {
+    assert(var.is_name());
+    for (Index i = label_stack_.size(); i > 0; --i) {
+      label = &label_stack_[i - 1];
+      if (label->name == var.name())
+        break;
+    }
+  }
+
+  assert(label);
+  label->used = true;
+  return label;
+}
+
+bool CWriter::IsTopLabelUsed() const {
+  assert(!label_stack_.empty());
+  return label_stack_.back().used;
+}
+
+void CWriter::PopLabel() {
+  label_stack_.pop_back();
+}
+
+// static
+std::string CWriter::AddressOf(const std::string& s) {
+  return s;
+}
+
+// static
+std::string CWriter::Deref(const std::string& s) {
+  return s;
+}
+
+// static
+char CWriter::MangleType(Type type) {
+  switch (type) {
+    case Type::I32: return 'i';
+    case Type::I64: return 'j';
+    case Type::F32: return 'f';
+    case Type::F64: return 'd';
+    default:
+      BRS_UNREACHABLE;
+      return '_';
+  }
+}
+
+std::string CWriter::LegalizeNameNoAddons(string_view name) {
+  std::string result;
+  for (size_t i = 0; i < name.size(); ++i)
+    result += isalnum(name[i]) ? tolower(name[i]) : '_';
+  return result;
+}
+
+uint32_t adler32(const uint8_t* data, size_t len) {
+  const uint32_t MOD_ADLER = 65521;
+  uint32_t a = 1, b = 0;
+  for (size_t i = 0; i < len; ++i) {
+    a = (a + data[i]) % MOD_ADLER;
+    b = (b + a) % MOD_ADLER;
+  }
+  return (b << 16) | a;
+}
+
+std::string CWriter::LegalizeName(const std::string& prefix, const std::string& module_name, string_view name) {
+  const std::string legalized = LegalizeNameNoAddons(name);
+  const std::string module_prefix = module_name == "env" ? "" : module_name + "_";
+  const std::string output = prefix + module_prefix + legalized;
+  return legalized == name
+    ? output
+    : output + "_" + std::to_string(adler32((const uint8_t*)name.begin(), name.length()));
+}
+
+static std::string ToBase36(size_t value) {
+  std::string result;
+  do {
+    result += "0123456789abcdefghijklmnopqrstuvwxyz"[value % 36];
+    value /= 36;
+  } while (value != 0);
+  std::reverse(result.begin(), result.end());
+  return result;
+}
+
+std::string CWriter::DefineName(SymbolSet* set, string_view name, const std::string& prefix) {
+  // Names on m (globals, memory and tables) can be read by the host, so only
+  // functions and locals are minified. Local names start with an underscore,
+  // which no keyword or builtin function does.
+  if (options_.minify && prefix.empty()) {
+    const bool is_global = set == &global_syms_;
+    std::string minified;
+    do {
+      minified = is_global ? options_.name_prefix + "_" + ToBase36(minified_global_count_++)
+                           : "_" + ToBase36(minified_local_count_++);
+    } while (set->find(minified) != set->end());
+    set->insert(minified);
+    if (is_global) {
+      minified_names_.emplace_back(minified, name.to_string());
+    }
+    return minified;
+  }
+
+  std::string legal = LegalizeName(prefix, options_.name_prefix, name);
+  if (set->find(legal) != set->end()) {
+    std::string base = legal + "_";
+    size_t count = 0;
+    do {
+      legal = base + std::to_string(count++);
+    } while (set->find(legal) != set->end());
+  }
+  set->insert(legal);
+  return legal;
+}
+
+string_view StripLeadingDollar(string_view name) {
+  if (!name.empty() && name[0] == '$') {
+    name.remove_prefix(1);
+  }
+  return name;
+}
+
+std::string CWriter::DefineImportName(const std::string& name,
+                                      string_view module,
+                                      string_view mangled_field_name) {
+  std::string mangled = mangled_field_name.to_string();
+  import_syms_.insert(name);
+  global_syms_.insert(mangled);
+  global_sym_map_.insert(SymbolMap::value_type(name, mangled));
+  return mangled;
+}
+
+std::string CWriter::DefineGlobalScopeName(const std::string& name, const std::string& prefix) {
+  std::string unique = DefineName(&global_syms_, StripLeadingDollar(name), prefix);
+  global_sym_map_.insert(SymbolMap::value_type(name, unique));
+  return unique;
+}
+
+std::string CWriter::DefineLocalScopeName(const std::string& name) {
+  std::string unique = DefineName(&local_syms_, StripLeadingDollar(name));
+  local_sym_map_.insert(SymbolMap::value_type(name, unique));
+  return unique;
+}
+
+std::string CWriter::DefineStackVarName(Index index,
+                                        Type type,
+                                        string_view name) {
+  std::string unique = DefineName(&local_syms_, name);
+  StackTypePair stp = {index, type};
+  stack_var_sym_map_.insert(StackVarSymbolMap::value_type(stp, unique));
+  return unique;
+}
+
+// Joins simple statements onto one line with ":" and drops comment lines.
+// Block statements, labels and multi-line literals are left on their own lines.
+static std::string PackStatements(const std::string& code) {
+  const size_t kMaxLineLength = 1024;
+  std::string result;
+  bool last_packable = false;
+  size_t line_begin = 0;
+  size_t literal_depth = 0;
+  size_t packed_length = 0;
+  while (line_begin < code.size()) {
+    size_t line_end = code.find('\n', line_begin);
+    if (line_end == std::string::npos) {
+      line_end = code.size();
+    }
+    const std::string line = code.substr(line_begin, line_end - line_begin);
+    line_begin = line_end + 1;
+    if (line.empty() || line[0] == '\'') {
+      continue;
+    }
+
+    const std::string first_word = line.substr(0, line.find(' '));
+    const char last = line.back();
+    if ((line[0] == ']' || line[0] == '}') && literal_depth != 0) {
+      --literal_depth;
+    }
+    const bool packable = literal_depth == 0 && last != ':' && last != '[' && last != '{' &&
+        first_word != "If" && first_word != "Else" && first_word != "End" && first_word != "Function";
+    if (last == '[' || last == '{') {
+      ++literal_depth;
+    }
+
+    if (packable && last_packable && packed_length + line.size() + 3 <= kMaxLineLength) {
+      result += " : ";
+      packed_length += line.size() + 3;
+    } else {
+      if (!result.empty()) {
+        result += '\n';
+      }
+      packed_length = line.size();
+    }
+    result += line;
+    last_packable = packable;
+  }
+  return result;
+}
+
+void CWriter::EndChunk() {
+  auto buffer = stream_.ReleaseOutputBuffer();
+  chunks_.emplace_back(std::string((const char*)buffer->data.data(), buffer->data.size()));
+  if (options_.minify) {
+    chunks_.back() = PackStatements(chunks_.back());
+  }
+  stream_.Clear();
+  stream_.ClearOffset();
+}
+
+void CWriter::Indent(int size) {
+  indent_ += size;
+}
+
+void CWriter::Dedent(int size) {
+  indent_ -= size;
+  assert(indent_ >= 0);
+}
+
+void CWriter::WriteIndent() {
+  if (options_.minify) {
+    return;
+  }
   static char s_indent[] =
       "                                                                       "
       "                                                                       ";
@@ -518,602 +1738,2099 @@ void CWriter::WriteIndent() {
     stream_.WriteData(s_indent, s_indent_len);
     to_write -= s_indent_len;
   }
-  if (to_write > 0) {
-    stream_.WriteData(s_indent, to_write);
+  if (to_write > 0) {
+    stream_.WriteData(s_indent, to_write);
+  }
+}
+
+void CWriter::WriteData(const void* src, size_t size) {
+  if (should_write_indent_next_) {
+    WriteIndent();
+    should_write_indent_next_ = false;
+  }
+  stream_.WriteData(src, size);
+}
+
+void WABT_PRINTF_FORMAT(2, 3) CWriter::Writef(const char* format, ...) {
+  WABT_SNPRINTF_ALLOCA(buffer, length, format);
+  WriteData(buffer, length);
+}
+
+void CWriter::Write(Newline) {
+  Write("\n");
+  should_write_indent_next_ = true;
+}
+
+void CWriter::Write(OpenBrace) {
+  Indent();
+  Write(Newline());
+}
+
+void CWriter::Write(CloseBrace) {
+  Dedent();
+}
+
+void CWriter::Write(Index index) {
+  Writef("%" PRIindex, index);
+}
+
+void CWriter::Write(string_view s) {
+  WriteData(s.data(), s.size());
+}
+
+void CWriter::Write(const LocalName& name) {
+  assert(local_sym_map_.count(name.name) == 1);
+  Write(local_sym_map_[name.name]);
+}
+
+std::string CWriter::GetGlobalName(const std::string& name) const {
+  if (global_sym_map_.count(name) != 1) {
+    std::cerr << "########################## Invalid GetGlobalName: " << name << std::endl << std::flush;
+    return "BAD_" + name;
+  }
+  assert(global_sym_map_.count(name) == 1);
+  auto iter = global_sym_map_.find(name);
+  assert(iter != global_sym_map_.end());
+  return iter->second;
+}
+
+void CWriter::Write(const GlobalName& name) {
+  Write(GetGlobalName(name.name));
+}
+
+void CWriter::Write(const ExternalPtr& name) {
+  bool is_import = import_syms_.count(name.name) != 0;
+  if (is_import) {
+    Write(GetGlobalName(name.name));
+  } else {
+    Write(AddressOf(GetGlobalName(name.name)));
+  }
+}
+
+void CWriter::Write(const ExternalRef& name) {
+  Write(GetGlobalName(name.name));
+}
+
+void CWriter::Write(const Var& var) {
+  assert(var.is_name());
+  Write(LocalName(var.name()));
+}
+
+void CWriter::Write(const GotoLabel& goto_label) {
+  const Label* label = FindLabel(goto_label.var);
+  if (label->HasValue()) {
+    assert(label->sig.size() == 1);
+    assert(type_stack_.size() >= label->type_stack_size);
+    Index dst = type_stack_.size() - label->type_stack_size - 1;
+    if (dst != 0)
+      Write(StackVar(dst, label->sig[0]), " = ", StackVar(0), Newline());
+  }
+
+  if (goto_label.var.is_name()) {
+    Write("Goto ", goto_label.var);
+  } else {
+    // We've generated names for all labels, so we should only be using an
+    // index when branching to the implicit function label, which can't be
+    // named.
+    Write("Goto ", Var(kImplicitFuncLabel));
+  }
+}
+
+void CWriter::Write(const LabelDecl& label) {
+  if (IsTopLabelUsed())
+    WriteLabelRaw(label);
+}
+
+void CWriter::WriteLabelRaw(const LabelDecl& label) {
+  Write(label.name, ":", Newline());
+  ++label_count_;
+}
+
+void CWriter::Write(const GlobalVar& var) {
+  assert(var.var.is_name());
+  Write(ExternalRef(var.var.name()));
+}
+
+void CWriter::Write(const StackVar& sv) {
+  Index index = type_stack_.size() - 1 - sv.index;
+  Type type = sv.type;
+  if (type == Type::Any) {
+    assert(index < type_stack_.size());
+    type = type_stack_[index];
+  }
+
+  StackTypePair stp = {index, type};
+  auto iter = stack_var_sym_map_.find(stp);
+  if (iter == stack_var_sym_map_.end()) {
+    std::string name = MangleType(type) + std::to_string(index);
+    Write(DefineStackVarName(index, type, name));
+  } else {
+    Write(iter->second);
+  }
+}
+
+void CWriter::Write(const StackValue& sv) {
+  const StackValueInfo& info = StackInfo(sv.index);
+  if (!info.pending) {
+    Write(StackVar(sv.index));
+    return;
+  }
+
+  if (info.sign_extended) {
+    Write("(", StackVar(sv.index, Type::I32), " + 0&)");
+    return;
+  }
+
+  // Negative float literals are wrapped so they can follow any operator.
+  const bool negative =
+    (info.value.type() == Type::F32 && (info.value.f32_bits() & 0x80000000u)) ||
+    (info.value.type() == Type::F64 && (info.value.f64_bits() & 0x8000000000000000ull));
+  if (negative) {
+    Write("(", info.value, ")");
+  } else {
+    Write(info.value);
+  }
+}
+
+void CWriter::Write(Type type) {
+  switch (type) {
+    case Type::I32: Write("Integer"); break;
+    case Type::I64: Write("LongInteger"); break;
+    case Type::F32: Write("Float"); break;
+    case Type::F64: Write("Double"); break;
+    default:
+      BRS_UNREACHABLE;
+  }
+}
+
+void CWriter::Write(TypeEnum type) {
+  switch (type.type) {
+    case Type::I32: Write("WASM_RT_I32"); break;
+    case Type::I64: Write("WASM_RT_I64"); break;
+    case Type::F32: Write("WASM_RT_F32"); break;
+    case Type::F64: Write("WASM_RT_F64"); break;
+    default:
+      BRS_UNREACHABLE;
+  }
+}
+
+void CWriter::Write(SignedType type) {
+  switch (type.type) {
+    case Type::I32: Write("Integer"); break;
+    case Type::I64: Write("LongInteger"); break;
+    default:
+      BRS_UNREACHABLE;
+  }
+}
+
+void CWriter::Write(const ResultType& rt) {
+  if (rt.types.size() == 1) {
+    Write(rt.types[0]);
+  } else if (rt.types.size() > 1) {
+    Write("Object");
+  } else {
+    Write("Void");
+  }
+}
+
+void CWriter::Write(const Const& const_) {
+  switch (const_.type()) {
+    case Type::I32:
+      Writef("%u%%", static_cast<int32_t>(const_.u32()));
+      break;
+
+    case Type::I64:
+      Writef("%" PRIu64 "&", static_cast<int64_t>(const_.u64()));
+      break;
+
+    case Type::F32: {
+      uint32_t f32_bits = const_.f32_bits();
+      // TODO(binji): Share with similar float info in interp.cc and literal.cc
+      if ((f32_bits & 0x7f800000u) == 0x7f800000u) {
+        const char* sign = (f32_bits & 0x80000000) ? "-" : "";
+        uint32_t significand = f32_bits & 0x7fffffu;
+        if (significand == 0) {
+          // Infinity.
+          Writef("%sFloatInf()", sign);
+        } else {
+          // Nan.
+          Writef("FloatNan()");
+        }
+      } else if (f32_bits == 0x80000000) {
+        // Negative zero. Special-cased so it isn't written as -0 below.
+        Writef("-0.0!");
+      } else {
+        Writef("%.9g!", Bitcast<float>(f32_bits));
+      }
+      break;
+    }
+
+    case Type::F64: {
+      uint64_t f64_bits = const_.f64_bits();
+      // TODO(binji): Share with similar float info in interp.cc and literal.cc
+      if ((f64_bits & 0x7ff0000000000000ull) == 0x7ff0000000000000ull) {
+        const char* sign = (f64_bits & 0x8000000000000000ull) ? "-" : "";
+        uint64_t significand = f64_bits & 0xfffffffffffffull;
+        if (significand == 0) {
+          // Infinity.
+          Writef("%sDoubleInf()", sign);
+        } else {
+          // Nan.
+          Writef("DoubleNan()");
+        }
+      } else if (f64_bits == 0x8000000000000000ull) {
+        // Negative zero. Special-cased so it isn't written as -0 below.
+        Writef("-0.0#");
+      } else {
+        Writef("%.17g#", Bitcast<double>(f64_bits));
+      }
+      break;
+    }
+
+    default:
+      BRS_UNREACHABLE;
+  }
+}
+
+void CWriter::WriteInitExpr(const ExprList& expr_list) {
+  if (expr_list.empty())
+    return;
+
+  assert(expr_list.size() == 1);
+  const Expr* expr = &expr_list.front();
+  switch (expr_list.front().type()) {
+    case ExprType::Const:
+      Write(cast<ConstExpr>(expr)->const_);
+      break;
+
+    case ExprType::GlobalGet:
+      Write(GlobalVar(cast<GlobalGetExpr>(expr)->var));
+      break;
+
+    default:
+      BRS_UNREACHABLE;
+  }
+}
+
+void CWriter::WriteFuncTypes() {
+  Write(Newline());
+  Writef("static u32 func_types[%" PRIzd "];", module_->types.size());
+  Write(Newline(), Newline());
+  Write("static void InitFuncTypes(void) {", Newline());
+  Index func_type_index = 0;
+  for (TypeEntry* type : module_->types) {
+    FuncType* func_type = cast<FuncType>(type);
+    Index num_params = func_type->GetNumParams();
+    Index num_results = func_type->GetNumResults();
+    Write("  func_types[", func_type_index, "] = wasm_rt_register_func_type(",
+          num_params, ", ", num_results);
+    for (Index i = 0; i < num_params; ++i) {
+      Write(", ", TypeEnum(func_type->GetParamType(i)));
+    }
+
+    for (Index i = 0; i < num_results; ++i) {
+      Write(", ", TypeEnum(func_type->GetResultType(i)));
+    }
+
+    Write(")", Newline());
+    ++func_type_index;
+  }
+  Write("}", Newline());
+}
+
+void CWriter::WriteImports() {
+  if (module_->imports.empty())
+    return;
+
+  // TODO(binji): Write imports ordered by type.
+  for (const Import* import : module_->imports) {
+    const std::string legal_module_name = LegalizeNameNoAddons(import->module_name);
+    Write("' import: '", import->module_name, "' '", import->field_name, "'", Newline());
+    Write("' ");
+    switch (import->kind()) {
+      case ExternalKind::Func: {
+        const Func& func = cast<FuncImport>(import)->func;
+        WriteFuncDeclaration(
+            func.decl,
+            DefineImportName(
+                func.name, import->module_name,
+                LegalizeName("", legal_module_name, import->field_name)));
+        break;
+      }
+
+      case ExternalKind::Global: {
+        const Global& global = cast<GlobalImport>(import)->global;
+        WriteGlobal(global,
+                    DefineImportName(
+                        global.name, import->module_name,
+                        LegalizeName("m.", legal_module_name, import->field_name)));
+        break;
+      }
+
+      case ExternalKind::Memory: {
+        const Memory& memory = cast<MemoryImport>(import)->memory;
+        WriteMemory(DefineImportName(memory.name, import->module_name,
+                                     LegalizeName("m.", legal_module_name, import->field_name)));
+        break;
+      }
+
+      case ExternalKind::Table: {
+        const Table& table = cast<TableImport>(import)->table;
+        WriteTable(DefineImportName(table.name, import->module_name,
+                                    LegalizeName("m.", legal_module_name, import->field_name)));
+        break;
+      }
+
+      default:
+        BRS_UNREACHABLE;
+    }
+
+    Write(Newline());
+  }
+  EndChunk();
+}
+
+void CWriter::DefineFuncDeclarations() {
+  if (module_->funcs.size() == module_->num_func_imports)
+    return;
+
+  Index func_index = 0;
+  for (const Func* func : module_->funcs) {
+    bool is_import = func_index < module_->num_func_imports;
+    if (!is_import) {
+      DefineGlobalScopeName(func->name);
+    }
+    ++func_index;
+  }
+}
+
+void CWriter::WriteFuncDeclaration(const FuncDeclaration& decl,
+                                   const std::string& name) {
+  Write("Function ", name, "(");
+  for (Index i = 0; i < decl.GetNumParams(); ++i) {
+    if (i != 0)
+      Write(", ");
+    Write("p" + std::to_string(i), " As ", decl.GetParamType(i));
+  }
+  Write(") As ", ResultType(decl.sig.result_types));
+}
+
+void CWriter::WriteGlobals() {
+  Index global_index = 0;
+  if (module_->globals.size() != module_->num_global_imports) {
+    for (const Global* global : module_->globals) {
+      bool is_import = global_index < module_->num_global_imports;
+      if (!is_import) {
+        DefineGlobalScopeName(global->name, "m.");
+      }
+      ++global_index;
+    }
+  }
+
+  // All the globals are added to m at once from one associative array literal.
+  Write("Function ", options_.name_prefix, "_InitGlobals__()", OpenBrace());
+  if (module_->globals.size() != module_->num_global_imports) {
+    Write("m.Append({", Newline());
+    for (Index global_index = module_->num_global_imports; global_index < module_->globals.size(); ++global_index) {
+      const Global* global = module_->globals[global_index];
+      const std::string name = GetGlobalName(global->name);
+      assert(name.compare(0, 2, "m.") == 0);
+      Write("\"", name.substr(2), "\": ");
+      if (options_.snapshot) {
+        Write(options_.snapshot->globals[global_index]);
+      } else {
+        assert(!global->init_expr.empty());
+        WriteInitExpr(global->init_expr);
+      }
+      Write(Newline());
+    }
+    Write("})", Newline());
+  }
+  Write(CloseBrace(), "End Function");
+  EndChunk();
+}
+
+void CWriter::WriteGlobal(const Global& global, const std::string& name) {
+  Write(global.type, " ", name);
+}
+
+void CWriter::DefineMemories() {
+  if (module_->memories.size() == module_->num_memory_imports)
+    return;
+
+  assert(module_->memories.size() <= 1);
+  Index memory_index = 0;
+  for (const Memory* memory : module_->memories) {
+    bool is_import = memory_index < module_->num_memory_imports;
+    if (!is_import) {
+      DefineGlobalScopeName(memory->name, "m.");
+    }
+    ++memory_index;
+  }
+}
+
+void CWriter::WriteMemory(const std::string& name) {
+  Write("Function ", name, " As Object");
+}
+
+void CWriter::DefineTables() {
+  if (module_->tables.size() == module_->num_table_imports)
+    return;
+
+  assert(module_->tables.size() <= 1);
+  Index table_index = 0;
+  for (const Table* table : module_->tables) {
+    bool is_import = table_index < module_->num_table_imports;
+    if (!is_import) {
+      DefineGlobalScopeName(table->name, "m.");
+    }
+    ++table_index;
+  }
+}
+
+void CWriter::WriteTable(const std::string& name) {
+  Write("wasm_rt_table_t ", name);
+}
+
+void CWriter::WriteDataInitializers() {
+  const Memory* memory = module_->memories.empty() ? nullptr : module_->memories[0];
+  const Snapshot* snapshot = options_.snapshot;
+
+  // A snapshot includes any pages grown during initialization.
+  const uint64_t memory_size = snapshot ? snapshot->memory.size() :
+      memory ? uint64_t(memory->page_limits.initial) * WABT_PAGE_SIZE : 0;
+
+  Write("Function ", options_.name_prefix, "_InitMemory__()", OpenBrace());
+  if (memory && module_->num_memory_imports == 0) {
+    uint32_t max =
+        memory->page_limits.has_max ? memory->page_limits.max : 65536;
+    Write(ExternalPtr(memory->name), " = CreateObject(\"roByteArray\")", Newline());
+    Write(ExternalPtr(memory->name), "[", memory_size, "] = 0", Newline());
+    Write(ExternalPtr(memory->name), "Max = ", max, Newline());
+  }
+
+  // Segments at constant offsets are combined into one image that the device
+  // reads natively, instead of parsing hex and copying it byte by byte.
+  std::vector<uint8_t> image;
+  std::vector<const DataSegment*> hex_segments;
+  if (snapshot) {
+    image = snapshot->memory;
+  } else if (options_.data_file && memory && module_->num_memory_imports == 0) {
+    for (const DataSegment* data_segment : module_->data_segments) {
+      if (data_segment->kind == SegmentKind::Passive) {
+        continue;
+      }
+      uint32_t offset = 0;
+      if (!GetConstOffset(data_segment->offset, &offset)) {
+        hex_segments.push_back(data_segment);
+        continue;
+      }
+      const size_t end = offset + data_segment->data.size();
+      if (image.size() < end) {
+        image.resize(end);
+      }
+      std::copy(data_segment->data.begin(), data_segment->data.end(), image.begin() + offset);
+    }
+  } else {
+    for (const DataSegment* data_segment : module_->data_segments) {
+      if (data_segment->kind != SegmentKind::Passive) {
+        hex_segments.push_back(data_segment);
+      }
+    }
+  }
+
+  // Sizing the memory already zeroes everything past the image.
+  while (!image.empty() && image.back() == 0) {
+    image.pop_back();
+  }
+
+  if (!image.empty() && options_.data_file) {
+    const std::string filename = GetSidecarFilename(".bin");
+    FileStream file(filename.c_str());
+    file.WriteData(image.data(), image.size());
+
+    const std::string path = options_.data_file_dir + filename.substr(filename.find_last_of("/") + 1);
+    Write("If Not ", ExternalPtr(memory->name), ".ReadFile(\"", path, "\") Then", OpenBrace());
+    Write("Throw \"Unable to read ", path, "\"", Newline());
+    Write(CloseBrace(), "End If", Newline());
+    // Reading the file replaces the contents, so size the memory afterwards.
+    Write(ExternalPtr(memory->name), "[", memory_size, "] = 0", Newline());
+    image.clear();
+  }
+
+  if (!image.empty() || !hex_segments.empty()) {
+    Write("segment = CreateObject(\"roByteArray\")", Newline());
+  }
+
+  // A snapshot image is mostly zeroes (heap and stack), so only copy the runs
+  // of non-zero bytes, splitting wherever there is a long enough zero gap.
+  const size_t kMinZeroGap = 64;
+  size_t run_begin = 0;
+  while (run_begin < image.size()) {
+    while (image[run_begin] == 0) {
+      ++run_begin;
+    }
+    size_t run_end = run_begin;
+    size_t zeroes = 0;
+    for (size_t i = run_begin; i < image.size() && zeroes < kMinZeroGap; ++i) {
+      if (image[i] == 0) {
+        ++zeroes;
+      } else {
+        zeroes = 0;
+        run_end = i + 1;
+      }
+    }
+
+    Write("segment.FromHexString(\"");
+    for (size_t i = run_begin; i < run_end; ++i) {
+      Writef("%02x", image[i]);
+    }
+    Write("\")", Newline());
+    Write("MemoryCopy(", ExternalRef(memory->name), ", ", run_begin, ", segment, 0, ", run_end - run_begin, ")", Newline());
+    run_begin = run_end;
+  }
+
+  Index data_segment_index = 0;
+  for (const DataSegment* data_segment : hex_segments) {
+    Write("segment.FromHexString(\"");
+    for (uint8_t x : data_segment->data) {
+      Writef("%02x", x);
+    }
+    Write("\")", Newline());
+
+    Write("MemoryCopy(", ExternalRef(memory->name), ", ");
+    WriteInitExpr(data_segment->offset);
+    Write(", segment, 0, ", data_segment->data.size(), ")", Newline());
+    ++data_segment_index;
+  }
+
+  Write(CloseBrace(), "End Function");
+  EndChunk();
+
+  // Passive segments stay hex strings until memory.init copies them in, and
+  // are replaced by an empty string when dropped. Active ones are empty. This
+  // is separate from the memory so that loading a snapshot sets it up too.
+  Write("Function ", options_.name_prefix, "_InitDataSegments__()", OpenBrace());
+  if (AnyPassiveDataSegments()) {
+    Write("m.", options_.name_prefix, "_data__ = [", Newline());
+    for (const DataSegment* data_segment : module_->data_segments) {
+      Write("\"");
+      if (data_segment->kind == SegmentKind::Passive) {
+        for (uint8_t x : data_segment->data) {
+          Writef("%02x", x);
+        }
+      }
+      Write("\"", Newline());
+    }
+    Write("]", Newline());
+  }
+  Write(CloseBrace(), "End Function");
+  EndChunk();
+}
+
+bool CWriter::AnyPassiveDataSegments() const {
+  return std::any_of(module_->data_segments.begin(), module_->data_segments.end(),
+      [](const DataSegment* data_segment) { return data_segment->kind == SegmentKind::Passive; });
+}
+
+void CWriter::WriteElemInitializers() {
+  const Table* table = module_->tables.empty() ? nullptr : module_->tables[0];
+  const bool is_import = table && module_->num_table_imports != 0;
+
+  // Entries at constant offsets (or all of them, from a snapshot) are merged
+  // and built with one array literal instead of a statement per entry.
+  std::vector<const Func*> elements;
+  std::vector<const ElemSegment*> offset_segments;
+  if (options_.snapshot) {
+    for (Index func_index : options_.snapshot->table) {
+      elements.push_back(func_index == kInvalidIndex ? nullptr : GetFoldedFunc(func_index));
+    }
+  } else {
+    for (const ElemSegment* elem_segment : module_->elem_segments) {
+      // Only active segments are written to the table at startup.
+      if (elem_segment->kind != SegmentKind::Active) {
+        continue;
+      }
+      uint32_t offset = 0;
+      if (is_import || !GetConstOffset(elem_segment->offset, &offset)) {
+        offset_segments.push_back(elem_segment);
+        continue;
+      }
+      const size_t end = offset + elem_segment->elem_exprs.size();
+      if (elements.size() < end) {
+        elements.resize(end);
+      }
+      for (const ElemExpr& elem_expr : elem_segment->elem_exprs) {
+        // With bulk memory, active segments may also hold ref.null entries,
+        // which are written as invalid.
+        elements[offset++] = elem_expr.kind == ElemExprKind::RefFunc ?
+            GetFoldedFunc(module_->GetFuncIndex(elem_expr.var)) : nullptr;
+      }
+    }
+  }
+
+  Write("Function ", options_.name_prefix, "_InitTable__()", OpenBrace());
+  if (table && !is_import) {
+    Write(ExternalPtr(table->name), " = [");
+    const size_t kElementsPerLine = 16;
+    for (size_t i = 0; i < elements.size(); ++i) {
+      if (i % kElementsPerLine == 0) {
+        Write(Newline());
+      } else {
+        Write(", ");
+      }
+      if (elements[i]) {
+        Write(ExternalPtr(elements[i]->name));
+      } else {
+        Write("invalid");
+      }
+    }
+    if (!elements.empty()) {
+      Write(Newline());
+    }
+    Write("]", Newline());
+  }
+  for (const ElemSegment* elem_segment : offset_segments) {
+    Write("offset = ");
+    WriteInitExpr(elem_segment->offset);
+    Write(Newline());
+
+    size_t i = 0;
+    for (const ElemExpr& elem_expr : elem_segment->elem_exprs) {
+      Write(ExternalRef(table->name), "[offset + ", i, "] = ");
+      if (elem_expr.kind == ElemExprKind::RefFunc) {
+        Write(ExternalPtr(GetFoldedFunc(module_->GetFuncIndex(elem_expr.var))->name), Newline());
+      } else {
+        Write("invalid", Newline());
+      }
+      ++i;
+    }
+  }
+
+  Write(CloseBrace(), "End Function");
+  EndChunk();
+}
+
+void CWriter::WriteInitExports() {
+  Write("Function ", options_.name_prefix, "_InitExports__()", OpenBrace());
+  WriteExports();
+  Write(CloseBrace(), "End Function", Newline());
+
+  // Here we only export functions since they are global and not done with m.something
+  for (const Export* export_ : module_->exports) {
+    if (export_->kind != ExternalKind::Func) {
+      continue;
+    }
+    const Func* func = module_->GetFunc(export_->var);
+    const std::string mangled_name = LegalizeName("", options_.name_prefix, export_->name);
+
+    // If the name is the same as the export, don't bother wrapping it
+    if (mangled_name == GetGlobalName(func->name)) {
+      continue;
+    }
+
+    Write("' export: '", options_.name_prefix, "' '", module_->name, "' '", export_->name, "'", Newline());
+    Write("Function ", mangled_name, "(");
+    for (Index i = 0; i < func->GetNumParams(); ++i) {
+      if (i != 0) {
+        Write(", ");
+      }
+      Write("p", i, " As ", func->GetParamType(i));
+    }
+    Write(")", OpenBrace());
+
+    Write("Return ", ExternalPtr(func->name), "(");
+    for (Index i = 0; i < func->GetNumParams(); ++i) {
+      if (i != 0) {
+        Write(", ");
+      }
+      Write("p", i);
+    }
+    Write(")", Newline());
+
+    Write(CloseBrace(), "End Function", Newline());
   }
+  EndChunk();
 }
 
-void CWriter::WriteData(const void* src, size_t size) {
-  if (should_write_indent_next_) {
-    WriteIndent();
-    should_write_indent_next_ = false;
+void CWriter::WriteExports() {
+  for (const Export* export_ : module_->exports) {
+    if (export_->kind == ExternalKind::Func) {
+      continue;
+    }
+
+    Write("' export: '", options_.name_prefix, "' '", module_->name, "' '", export_->name, "'", Newline());
+    const std::string mangled_name = LegalizeName("m.", options_.name_prefix, export_->name);
+    std::string internal_name;
+
+    switch (export_->kind) {
+      case ExternalKind::Global: {
+        const Global* global = module_->GetGlobal(export_->var);
+        internal_name = global->name;
+        break;
+      }
+
+      case ExternalKind::Memory: {
+        const Memory* memory = module_->GetMemory(export_->var);
+        internal_name = memory->name;
+        break;
+      }
+
+      case ExternalKind::Table: {
+        const Table* table = module_->GetTable(export_->var);
+        internal_name = table->name;
+        break;
+      }
+
+      default:
+        BRS_UNREACHABLE;
+    }
+
+    Write(mangled_name, " = ", ExternalPtr(internal_name), Newline());
   }
-  stream_.WriteData(src, size);
 }
 
-void WABT_PRINTF_FORMAT(2, 3) CWriter::Writef(const char* format, ...) {
-  WABT_SNPRINTF_ALLOCA(buffer, length, format);
-  WriteData(buffer, length);
+void CWriter::WriteInit() {
+  Write("Function ", options_.name_prefix, "Init__()", OpenBrace());
+  //Write("InitFuncTypes()", Newline());
+  Write(options_.name_prefix, "_InitGlobals__()", Newline());
+  Write(options_.name_prefix, "_InitMemory__()", Newline());
+  Write(options_.name_prefix, "_InitDataSegments__()", Newline());
+  Write(options_.name_prefix, "_InitTable__()", Newline());
+  Write(options_.name_prefix, "_InitExports__()", Newline());
+  // The start function already ran when the snapshot was taken.
+  if (!options_.snapshot) {
+    for (Var* var : module_->starts) {
+      Write(ExternalRef(module_->GetFunc(*var)->name), "()", Newline());
+    }
+  }
+  Write(CloseBrace(), "End Function");
+  EndChunk();
 }
 
-void CWriter::Write(Newline) {
-  Write("\n");
-  should_write_indent_next_ = true;
+static const char* GetMemoryAccessPrefix(Type type) {
+  switch (type) {
+    case Type::I32: return "I32";
+    case Type::I64: return "I64";
+    case Type::F32: return "F32";
+    case Type::F64: return "F64";
+    default: BRS_UNREACHABLE; return nullptr;
+  }
 }
 
-void CWriter::Write(OpenBrace) {
-  Indent();
-  Write(Newline());
+void CWriter::WriteSnapshotFunctions() {
+  const Memory* memory = module_->num_memory_imports == 0 && !module_->memories.empty() ? module_->memories[0] : nullptr;
+  const Index num_globals = module_->globals.size() - module_->num_global_imports;
+
+  // The globals are packed 8 bytes apiece so they round trip through the same
+  // load/store helpers as memory, followed by a byte per data segment that is
+  // 1 once a passive segment is dropped. Imported memory and globals belong to
+  // the host, and the table can't change after instantiation so it is just
+  // rebuilt.
+  const bool any_passive = AnyPassiveDataSegments();
+  const size_t num_segment_flags = any_passive ? module_->data_segments.size() : 0;
+  Write("Function ", options_.name_prefix, "SaveSnapshot__(path as String) as Boolean", OpenBrace());
+  Write("globals = CreateObject(\"roByteArray\")", Newline());
+  for (Index i = 0; i < num_globals; ++i) {
+    const Global* global = module_->globals[module_->num_global_imports + i];
+    Write(GetMemoryAccessPrefix(global->type), "Store(globals, ", i * 8, ", ", GlobalName(global->name), ")", Newline());
+  }
+  for (Index i = 0; i < num_segment_flags; ++i) {
+    const size_t flag = num_globals * 8 + i;
+    Write("globals[", flag, "] = 0", Newline());
+    if (module_->data_segments[i]->kind == SegmentKind::Passive) {
+      Write("If m.", options_.name_prefix, "_data__[", i, "] = \"\" Then globals[", flag, "] = 1", Newline());
+    }
+  }
+  Write("If Not globals.WriteFile(path + \".globals\") Then Return False", Newline());
+  if (memory) {
+    Write("If Not ", ExternalPtr(memory->name), ".WriteFile(path + \".memory\") Then Return False", Newline());
+  }
+  Write("Return True", Newline());
+  Write(CloseBrace(), "End Function");
+  EndChunk();
+
+  Write("Function ", options_.name_prefix, "LoadSnapshot__(path as String) as Boolean", OpenBrace());
+  Write("globals = CreateObject(\"roByteArray\")", Newline());
+  Write("If Not globals.ReadFile(path + \".globals\") Then Return False", Newline());
+  Write("If globals.Count() <> ", num_globals * 8 + num_segment_flags, " Then Return False", Newline());
+  if (memory) {
+    uint32_t max =
+        memory->page_limits.has_max ? memory->page_limits.max : 65536;
+    Write(ExternalPtr(memory->name), " = CreateObject(\"roByteArray\")", Newline());
+    Write("If Not ", ExternalPtr(memory->name), ".ReadFile(path + \".memory\") Then Return False", Newline());
+    Write(ExternalPtr(memory->name), "Max = ", max, Newline());
+  }
+  for (Index i = 0; i < num_globals; ++i) {
+    const Global* global = module_->globals[module_->num_global_imports + i];
+    Write(GlobalName(global->name), " = ", GetMemoryAccessPrefix(global->type), "Load(globals, ", i * 8, ")", Newline());
+  }
+  Write(options_.name_prefix, "_InitDataSegments__()", Newline());
+  for (Index i = 0; i < num_segment_flags; ++i) {
+    if (module_->data_segments[i]->kind == SegmentKind::Passive) {
+      Write("If globals[", num_globals * 8 + i, "] <> 0 Then m.", options_.name_prefix, "_data__[", i, "] = \"\"",
+            Newline());
+    }
+  }
+  Write(options_.name_prefix, "_InitTable__()", Newline());
+  Write(options_.name_prefix, "_InitExports__()", Newline());
+  Write("Return True", Newline());
+  Write(CloseBrace(), "End Function");
+  EndChunk();
 }
 
-void CWriter::Write(CloseBrace) {
-  Dedent();
+const MathIntrinsic* CWriter::FindMathIntrinsic(const Func& func) const {
+  if (options_.native_math == NativeMath::None) {
+    return nullptr;
+  }
+  for (const MathIntrinsic& intrinsic : s_math_intrinsics) {
+    if (func.name != intrinsic.name || func.GetNumParams() != intrinsic.num_params ||
+        func.GetNumResults() != 1 || func.GetResultType(0) != intrinsic.type) {
+      continue;
+    }
+    for (Index i = 0; i < func.GetNumParams(); ++i) {
+      if (func.GetParamType(i) != intrinsic.type) {
+        return nullptr;
+      }
+    }
+    const bool precise_enough = options_.native_math == NativeMath::All ||
+                                intrinsic.type == Type::F32 || intrinsic.exact;
+    return precise_enough ? &intrinsic : nullptr;
+  }
+  return nullptr;
 }
 
-void CWriter::Write(Index index) {
-  Writef("%" PRIindex, index);
+void CWriter::MarkReachableFuncs(std::vector<Index> worklist, std::vector<bool>* reachable) {
+  reachable->assign(module_->funcs.size(), false);
+  for (Index func_index : worklist) {
+    (*reachable)[func_index] = true;
+  }
+  auto add = [&](Index func_index) {
+    if (!(*reachable)[func_index]) {
+      (*reachable)[func_index] = true;
+      worklist.push_back(func_index);
+    }
+  };
+
+  while (!worklist.empty()) {
+    const Func* func = module_->funcs[worklist.back()];
+    worklist.pop_back();
+    // Replaced functions are never written, so neither is what they call.
+    if (FindIntrinsic(*module_, *func) || FindMathIntrinsic(*func)) {
+      continue;
+    }
+    ForEachExpr(func->exprs, [&](const Expr& expr) {
+      if (expr.type() == ExprType::Call) {
+        add(module_->GetFuncIndex(cast<CallExpr>(&expr)->var));
+      } else if (expr.type() == ExprType::ReturnCall) {
+        add(module_->GetFuncIndex(cast<ReturnCallExpr>(&expr)->var));
+      } else if (expr.type() == ExprType::RefFunc) {
+        add(module_->GetFuncIndex(cast<RefFuncExpr>(&expr)->var));
+      }
+    });
+  }
 }
 
-void CWriter::Write(string_view s) {
-  WriteData(s.data(), s.size());
+static bool IsFuncNamed(const Func* func, const std::vector<std::string>& names) {
+  return std::find(names.begin(), names.end(), StripLeadingDollar(func->name).to_string()) != names.end();
 }
 
-void CWriter::Write(const LocalName& name) {
-  assert(local_sym_map_.count(name.name) == 1);
-  Write(local_sym_map_[name.name]);
+void CWriter::ComputeReachableFuncs() {
+  std::vector<Index> roots;
+  for (const Export* export_ : module_->exports) {
+    if (export_->kind == ExternalKind::Func) {
+      roots.push_back(module_->GetFuncIndex(export_->var));
+    }
+  }
+  for (const Var* var : module_->starts) {
+    roots.push_back(module_->GetFuncIndex(*var));
+  }
+  for (const ElemSegment* elem_segment : module_->elem_segments) {
+    for (const ElemExpr& elem_expr : elem_segment->elem_exprs) {
+      if (elem_expr.kind == ElemExprKind::RefFunc) {
+        roots.push_back(module_->GetFuncIndex(elem_expr.var));
+      }
+    }
+  }
+  for (Index func_index = 0; func_index < module_->funcs.size(); ++func_index) {
+    if (IsFuncNamed(module_->funcs[func_index], options_.keep)) {
+      roots.push_back(func_index);
+    }
+  }
+  MarkReachableFuncs(std::move(roots), &reachable_funcs_);
+
+  named_funcs_.assign(module_->funcs.size(), false);
+  for (const Export* export_ : module_->exports) {
+    if (export_->kind == ExternalKind::Func) {
+      named_funcs_[module_->GetFuncIndex(export_->var)] = true;
+    }
+  }
+  for (const ElemSegment* elem_segment : module_->elem_segments) {
+    for (const ElemExpr& elem_expr : elem_segment->elem_exprs) {
+      if (elem_expr.kind == ElemExprKind::RefFunc) {
+        named_funcs_[module_->GetFuncIndex(elem_expr.var)] = true;
+      }
+    }
+  }
+  if (options_.snapshot) {
+    for (Index func_index : options_.snapshot->table) {
+      if (func_index != kInvalidIndex) {
+        named_funcs_[func_index] = true;
+      }
+    }
+  }
+  for (Index func_index = module_->num_func_imports; func_index < module_->funcs.size(); ++func_index) {
+    if (reachable_funcs_[func_index]) {
+      ForEachExpr(module_->funcs[func_index]->exprs, [&](const Expr& expr) {
+        if (expr.type() == ExprType::RefFunc) {
+          named_funcs_[module_->GetFuncIndex(cast<RefFuncExpr>(&expr)->var)] = true;
+        }
+      });
+    }
+  }
+
+  // With --lazy, only what the start function, exports and the named hot
+  // functions can reach is compiled at launch.
+  if (options_.lazy) {
+    roots.clear();
+    for (const Export* export_ : module_->exports) {
+      if (export_->kind == ExternalKind::Func) {
+        roots.push_back(module_->GetFuncIndex(export_->var));
+      }
+    }
+    for (const Var* var : module_->starts) {
+      roots.push_back(module_->GetFuncIndex(*var));
+    }
+    for (Index func_index = 0; func_index < module_->funcs.size(); ++func_index) {
+      if (IsFuncNamed(module_->funcs[func_index], options_.lazy_hot)) {
+        roots.push_back(func_index);
+      }
+    }
+    MarkReachableFuncs(std::move(roots), &hot_funcs_);
+  }
 }
 
-std::string CWriter::GetGlobalName(const std::string& name) const {
-  if (global_sym_map_.count(name) != 1) {
-    std::cerr << "########################## Invalid GetGlobalName: " << name << std::endl << std::flush;
-    return "BAD_" + name;
+void CWriter::ComputeResultArrays() {
+  result_array_funcs_.assign(module_->funcs.size(), false);
+  for (Index func_index = 0; func_index < module_->num_func_imports; ++func_index) {
+    result_array_funcs_[func_index] = true;
+  }
+  for (const Export* export_ : module_->exports) {
+    if (export_->kind == ExternalKind::Func) {
+      result_array_funcs_[module_->GetFuncIndex(export_->var)] = true;
+    }
+  }
+
+  // Every function in the table must agree with call_indirect, so if any of
+  // them needs an array, they all use one.
+  std::vector<Index> table_funcs;
+  for (const ElemSegment* elem_segment : module_->elem_segments) {
+    for (const ElemExpr& elem_expr : elem_segment->elem_exprs) {
+      if (elem_expr.kind == ElemExprKind::RefFunc) {
+        const Index func_index = module_->GetFuncIndex(elem_expr.var);
+        table_funcs.push_back(func_index);
+        table_result_arrays_ |= result_array_funcs_[func_index] && module_->funcs[func_index]->GetNumResults() > 1;
+      }
+    }
+  }
+  if (table_result_arrays_) {
+    for (Index func_index : table_funcs) {
+      result_array_funcs_[func_index] = true;
+    }
   }
-  assert(global_sym_map_.count(name) == 1);
-  auto iter = global_sym_map_.find(name);
-  assert(iter != global_sym_map_.end());
-  return iter->second;
 }
 
-void CWriter::Write(const GlobalName& name) {
-  Write(GetGlobalName(name.name));
+bool CWriter::ReturnsResultArray(const Func& func) const {
+  return func.GetNumResults() > 1 && result_array_funcs_[module_->GetFuncIndex(Var(func.name))];
 }
 
-void CWriter::Write(const ExternalPtr& name) {
-  bool is_import = import_syms_.count(name.name) != 0;
-  if (is_import) {
-    Write(GetGlobalName(name.name));
-  } else {
-    Write(AddressOf(GetGlobalName(name.name)));
+void CWriter::ComputeGlobalEffects() {
+  const size_t num_funcs = module_->funcs.size();
+  const size_t num_globals = module_->globals.size();
+  func_global_accesses_.assign(num_funcs, std::vector<bool>(num_globals, false));
+  func_global_writes_.assign(num_funcs, std::vector<bool>(num_globals, false));
+
+  std::vector<Index> table_funcs;
+  for (const ElemSegment* elem_segment : module_->elem_segments) {
+    for (const ElemExpr& elem_expr : elem_segment->elem_exprs) {
+      if (elem_expr.kind == ElemExprKind::RefFunc) {
+        table_funcs.push_back(module_->GetFuncIndex(elem_expr.var));
+      }
+    }
+  }
+
+  // The host may do anything, e.g. call back into an export.
+  std::vector<std::vector<Index>> callees(num_funcs);
+  for (Index func_index = 0; func_index < num_funcs; ++func_index) {
+    if (func_index < module_->num_func_imports) {
+      func_global_accesses_[func_index].assign(num_globals, true);
+      func_global_writes_[func_index].assign(num_globals, true);
+      continue;
+    }
+    ForEachExpr(module_->funcs[func_index]->exprs, [&](const Expr& expr) {
+      switch (expr.type()) {
+        case ExprType::GlobalGet:
+          func_global_accesses_[func_index][module_->GetGlobalIndex(cast<GlobalGetExpr>(&expr)->var)] = true;
+          break;
+        case ExprType::GlobalSet: {
+          const Index global_index = module_->GetGlobalIndex(cast<GlobalSetExpr>(&expr)->var);
+          func_global_accesses_[func_index][global_index] = true;
+          func_global_writes_[func_index][global_index] = true;
+          break;
+        }
+        case ExprType::Call:
+          callees[func_index].push_back(module_->GetFuncIndex(cast<CallExpr>(&expr)->var));
+          break;
+        case ExprType::ReturnCall:
+          callees[func_index].push_back(module_->GetFuncIndex(cast<ReturnCallExpr>(&expr)->var));
+          break;
+        case ExprType::CallIndirect:
+        case ExprType::ReturnCallIndirect:
+          callees[func_index].insert(callees[func_index].end(), table_funcs.begin(), table_funcs.end());
+          break;
+        default:
+          break;
+      }
+    });
+  }
+
+  auto merge = [](const std::vector<bool>& from, std::vector<bool>* to) {
+    bool changed = false;
+    for (size_t i = 0; i < from.size(); ++i) {
+      if (from[i] && !(*to)[i]) {
+        (*to)[i] = true;
+        changed = true;
+      }
+    }
+    return changed;
+  };
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (Index func_index = 0; func_index < num_funcs; ++func_index) {
+      for (Index callee : callees[func_index]) {
+        changed |= merge(func_global_accesses_[callee], &func_global_accesses_[func_index]);
+        changed |= merge(func_global_writes_[callee], &func_global_writes_[func_index]);
+      }
+    }
+  }
+
+  // A function with a frame puts the stack pointer back itself, and one
+  // without does when everything it calls does. Imports never count.
+  stack_pointer_restoring_funcs_.assign(num_funcs, false);
+  const Index stack_pointer = FindStackPointer();
+  if (stack_pointer != kInvalidIndex) {
+    std::vector<bool> has_frame(num_funcs, false);
+    for (Index func_index = module_->num_func_imports; func_index < num_funcs; ++func_index) {
+      bool frame = false;
+      stack_pointer_restoring_funcs_[func_index] =
+          HasFrameStackPointerWrites(*module_->funcs[func_index], stack_pointer, &frame);
+      has_frame[func_index] = frame;
+    }
+    changed = true;
+    while (changed) {
+      changed = false;
+      for (Index func_index = module_->num_func_imports; func_index < num_funcs; ++func_index) {
+        if (!stack_pointer_restoring_funcs_[func_index] || has_frame[func_index]) {
+          continue;
+        }
+        for (Index callee : callees[func_index]) {
+          if (!stack_pointer_restoring_funcs_[callee]) {
+            stack_pointer_restoring_funcs_[func_index] = false;
+            changed = true;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  table_global_accesses_.assign(num_globals, false);
+  table_global_writes_.assign(num_globals, false);
+  table_restores_stack_pointer_ = stack_pointer != kInvalidIndex && module_->num_table_imports == 0;
+  for (Index func_index : table_funcs) {
+    merge(func_global_accesses_[func_index], &table_global_accesses_);
+    merge(func_global_writes_[func_index], &table_global_writes_);
+    table_restores_stack_pointer_ = table_restores_stack_pointer_ && stack_pointer_restoring_funcs_[func_index];
   }
 }
 
-void CWriter::Write(const ExternalRef& name) {
-  Write(GetGlobalName(name.name));
+void CWriter::ComputeTableEntries() {
+  table_entries_.clear();
+  table_known_ = false;
+  if (module_->tables.empty() || module_->num_table_imports != 0) {
+    return;
+  }
+  // The host may change an exported table.
+  for (const Export* export_ : module_->exports) {
+    if (export_->kind == ExternalKind::Table) {
+      return;
+    }
+  }
+  if (options_.snapshot) {
+    table_entries_ = options_.snapshot->table;
+    table_known_ = true;
+    return;
+  }
+  for (const ElemSegment* elem_segment : module_->elem_segments) {
+    if (elem_segment->kind != SegmentKind::Active) {
+      continue;
+    }
+    uint32_t offset = 0;
+    if (!GetConstOffset(elem_segment->offset, &offset)) {
+      table_entries_.clear();
+      return;
+    }
+    const size_t end = offset + elem_segment->elem_exprs.size();
+    if (table_entries_.size() < end) {
+      table_entries_.resize(end, kInvalidIndex);
+    }
+    for (const ElemExpr& elem_expr : elem_segment->elem_exprs) {
+      table_entries_[offset++] = elem_expr.kind == ElemExprKind::RefFunc ?
+          module_->GetFuncIndex(elem_expr.var) : kInvalidIndex;
+    }
+  }
+  table_known_ = true;
 }
 
-void CWriter::Write(const Var& var) {
-  assert(var.is_name());
-  Write(LocalName(var.name()));
+static bool ConstEquals(const Const& a, const Const& b) {
+  if (a.type() != b.type()) {
+    return false;
+  }
+  switch (a.type()) {
+    case Type::I32:
+      return a.u32() == b.u32();
+    case Type::I64:
+      return a.u64() == b.u64();
+    case Type::F32:
+      return a.f32_bits() == b.f32_bits();
+    case Type::F64:
+      return a.f64_bits() == b.f64_bits();
+    default:
+      return false;
+  }
 }
 
-void CWriter::Write(const GotoLabel& goto_label) {
-  const Label* label = FindLabel(goto_label.var);
-  if (label->HasValue()) {
-    assert(label->sig.size() == 1);
-    assert(type_stack_.size() >= label->type_stack_size);
-    Index dst = type_stack_.size() - label->type_stack_size - 1;
-    if (dst != 0)
-      Write(StackVar(dst, label->sig[0]), " = ", StackVar(0), Newline());
+void CWriter::ComputeSpecializations() {
+  specializations_.assign(module_->funcs.size(), {});
+  // Small functions gain little, and large ones cost too much to copy.
+  const size_t kMinSize = 8;
+  const size_t kMaxSize = 1500;
+  const size_t kMinCallSites = 2;
+  const size_t kMaxPerFunc = 3;
+
+  std::vector<size_t> sizes(module_->funcs.size(), 0);
+  size_t total_size = 0;
+  for (Index func_index = module_->num_func_imports; func_index < module_->funcs.size(); ++func_index) {
+    ForEachExpr(module_->funcs[func_index]->exprs, [&](const Expr&) { ++sizes[func_index]; });
+    total_size += sizes[func_index];
   }
+  // Copies may grow the output by a tenth.
+  size_t budget = std::max<size_t>(total_size / 10, 2000);
+
+  auto can_specialize = [&](Index func_index) {
+    const Func* func = module_->funcs[func_index];
+    return func_index >= module_->num_func_imports && reachable_funcs_[func_index] &&
+           (!options_.lazy || hot_funcs_[func_index]) && !FindIntrinsic(*module_, *func) &&
+           !FindMathIntrinsic(*func) && sizes[func_index] >= kMinSize && sizes[func_index] <= kMaxSize;
+  };
 
-  if (goto_label.var.is_name()) {
-    Write("Goto ", goto_label.var);
-  } else {
-    // We've generated names for all labels, so we should only be using an
-    // index when branching to the implicit function label, which can't be
-    // named.
-    Write("Goto ", Var(kImplicitFuncLabel));
+  // Constant arguments are found when the call directly follows them, with
+  // only plain loads of locals and globals in between.
+  struct Candidate {
+    Index func_index;
+    std::map<Index, Const> params;
+    size_t call_sites;
+  };
+  std::map<std::string, Candidate> candidates;
+  auto visit_list = [&](const ExprList& exprs) {
+    for (auto iter = exprs.begin(); iter != exprs.end(); ++iter) {
+      if (iter->type() != ExprType::Call) {
+        continue;
+      }
+      const Index func_index = module_->GetFuncIndex(cast<CallExpr>(&*iter)->var);
+      if (!can_specialize(func_index)) {
+        continue;
+      }
+      std::map<Index, Const> params;
+      std::string key = std::to_string(func_index);
+      Index param = module_->funcs[func_index]->GetNumParams();
+      for (auto arg = iter; param != 0 && arg != exprs.begin(); ) {
+        --arg;
+        --param;
+        if (arg->type() == ExprType::Const) {
+          const Const& const_ = cast<ConstExpr>(&*arg)->const_;
+          params.emplace(param, const_);
+          key += " " + std::to_string(param) + ":" + std::to_string(static_cast<int>(const_.type())) + ":" +
+                 std::to_string(const_.type() == Type::I64 || const_.type() == Type::F64 ? const_.u64() : const_.u32());
+        } else if (arg->type() != ExprType::LocalGet && arg->type() != ExprType::GlobalGet) {
+          break;
+        }
+      }
+      if (!params.empty()) {
+        Candidate& candidate = candidates.emplace(key, Candidate{func_index, std::move(params), 0}).first->second;
+        ++candidate.call_sites;
+      }
+    }
+  };
+  std::function<void(const ExprList&)> visit = [&](const ExprList& exprs) {
+    visit_list(exprs);
+    for (const Expr& expr : exprs) {
+      if (expr.type() == ExprType::Block) {
+        visit(cast<BlockExpr>(&expr)->block.exprs);
+      } else if (expr.type() == ExprType::Loop) {
+        visit(cast<LoopExpr>(&expr)->block.exprs);
+      } else if (expr.type() == ExprType::If) {
+        visit(cast<IfExpr>(&expr)->true_.exprs);
+        visit(cast<IfExpr>(&expr)->false_);
+      }
+    }
+  };
+  for (Index func_index = module_->num_func_imports; func_index < module_->funcs.size(); ++func_index) {
+    if (reachable_funcs_[func_index]) {
+      visit(module_->funcs[func_index]->exprs);
+    }
   }
-}
 
-void CWriter::Write(const LabelDecl& label) {
-  if (IsTopLabelUsed())
-    WriteLabelRaw(label);
+  std::vector<Candidate*> ordered;
+  for (auto& pair : candidates) {
+    ordered.push_back(&pair.second);
+  }
+  std::stable_sort(ordered.begin(), ordered.end(), [](const Candidate* a, const Candidate* b) {
+    return a->call_sites > b->call_sites;
+  });
+  for (Candidate* candidate : ordered) {
+    const Index func_index = candidate->func_index;
+    const Func* func = module_->funcs[func_index];
+    std::vector<Specialization>& specializations = specializations_[func_index];
+    if (candidate->call_sites < kMinCallSites || specializations.size() >= kMaxPerFunc ||
+        sizes[func_index] > budget) {
+      continue;
+    }
+    // A parameter that is written isn't constant throughout.
+    bool written = false;
+    ForEachExpr(func->exprs, [&](const Expr& expr) {
+      const Var* var = expr.type() == ExprType::LocalSet ? &cast<LocalSetExpr>(&expr)->var :
+                       expr.type() == ExprType::LocalTee ? &cast<LocalTeeExpr>(&expr)->var :
+                       nullptr;
+      written |= var && candidate->params.count(func->GetLocalIndex(*var)) != 0;
+    });
+    if (written) {
+      continue;
+    }
+    budget -= sizes[func_index];
+    Specialization specialization;
+    specialization.name = func->name + " " + std::to_string(specializations.size());
+    DefineGlobalScopeName(specialization.name);
+    specialization.params = std::move(candidate->params);
+    specializations.push_back(std::move(specialization));
+  }
 }
 
-void CWriter::WriteLabelRaw(const LabelDecl& label) {
-  Write(label.name, ":", Newline());
-  ++label_count_;
+const Specialization* CWriter::FindSpecialization(Index func_index, Index num_params) {
+  for (const Specialization& specialization : specializations_[func_index]) {
+    bool matches = true;
+    for (const auto& pair : specialization.params) {
+      const Const* arg = GetStackConst(num_params - pair.first - 1);
+      matches &= arg && ConstEquals(*arg, pair.second);
+    }
+    if (matches) {
+      return &specialization;
+    }
+  }
+  return nullptr;
 }
 
-void CWriter::Write(const GlobalVar& var) {
-  assert(var.var.is_name());
-  Write(ExternalRef(var.var.name()));
+const Const* CWriter::GetSpecializedParam(Index local) const {
+  if (!specialization_) {
+    return nullptr;
+  }
+  auto iter = specialization_->params.find(local);
+  return iter == specialization_->params.end() ? nullptr : &iter->second;
 }
 
-void CWriter::Write(const StackVar& sv) {
-  Index index = type_stack_.size() - 1 - sv.index;
-  Type type = sv.type;
-  if (type == Type::Any) {
-    assert(index < type_stack_.size());
-    type = type_stack_[index];
+void CWriter::DefineGlobalCaches(const Func& func) {
+  global_caches_.clear();
+  dirty_global_caches_.clear();
+  // Each cache is another variable, so leave room under BrightScript's limit.
+  const Index kMaxCachingVariables = 192;
+  if (func.GetNumParamsAndLocals() >= kMaxCachingVariables) {
+    return;
   }
 
-  StackTypePair stp = {index, type};
-  auto iter = stack_var_sym_map_.find(stp);
-  if (iter == stack_var_sym_map_.end()) {
-    std::string name = MangleType(type) + std::to_string(index);
-    Write(DefineStackVarName(index, type, name));
-  } else {
-    Write(iter->second);
-  }
-}
+  std::map<Index, size_t> uses;
+  ForEachExpr(func.exprs, [&](const Expr& expr) {
+    if (expr.type() == ExprType::GlobalGet) {
+      ++uses[module_->GetGlobalIndex(cast<GlobalGetExpr>(&expr)->var)];
+    } else if (expr.type() == ExprType::GlobalSet) {
+      const Index global_index = module_->GetGlobalIndex(cast<GlobalSetExpr>(&expr)->var);
+      ++uses[global_index];
+      dirty_global_caches_.insert(global_index);
+    }
+  });
 
-void CWriter::Write(Type type) {
-  switch (type) {
-    case Type::I32: Write("Integer"); break;
-    case Type::I64: Write("LongInteger"); break;
-    case Type::F32: Write("Float"); break;
-    case Type::F64: Write("Double"); break;
-    default:
-      BRS_UNREACHABLE;
+  // A single use is no cheaper through a local.
+  for (const auto& pair : uses) {
+    if (pair.second > 1) {
+      const std::string& name = module_->globals[pair.first]->name;
+      global_caches_[pair.first] = DefineLocalScopeName("$" + StripLeadingDollar(name).to_string() + "$global");
+    }
   }
 }
 
-void CWriter::Write(TypeEnum type) {
-  switch (type.type) {
-    case Type::I32: Write("WASM_RT_I32"); break;
-    case Type::I64: Write("WASM_RT_I64"); break;
-    case Type::F32: Write("WASM_RT_F32"); break;
-    case Type::F64: Write("WASM_RT_F64"); break;
-    default:
-      BRS_UNREACHABLE;
+void CWriter::WriteGlobalCacheStores(const std::vector<bool>* accessed) {
+  for (Index global_index : dirty_global_caches_) {
+    auto iter = global_caches_.find(global_index);
+    if (iter != global_caches_.end() && (!accessed || (*accessed)[global_index])) {
+      Write(GlobalVar(Var(module_->globals[global_index]->name)), " = ", iter->second, Newline());
+    }
   }
 }
 
-void CWriter::Write(SignedType type) {
-  switch (type.type) {
-    case Type::I32: Write("Integer"); break;
-    case Type::I64: Write("LongInteger"); break;
-    default:
-      BRS_UNREACHABLE;
+void CWriter::WriteGlobalCacheLoads(const std::vector<bool>& written, bool restores_stack_pointer) {
+  const Index stack_pointer = restores_stack_pointer ? FindStackPointer() : kInvalidIndex;
+  for (const auto& pair : global_caches_) {
+    if (written[pair.first] && pair.first != stack_pointer) {
+      Write(pair.second, " = ", GlobalVar(Var(module_->globals[pair.first]->name)), Newline());
+    }
   }
 }
 
-void CWriter::Write(const ResultType& rt) {
-  if (rt.types.size() == 1) {
-    Write(rt.types[0]);
-  } else if (rt.types.size() > 1) {
-    Write("Object");
-  } else {
-    Write("Void");
+Index CWriter::FindStackPointer() const {
+  for (Index global_index = 0; global_index < module_->globals.size(); ++global_index) {
+    if (StripLeadingDollar(module_->globals[global_index]->name) == "__stack_pointer") {
+      return global_index;
+    }
   }
+  return kInvalidIndex;
 }
 
-void CWriter::Write(const Const& const_) {
-  switch (const_.type()) {
-    case Type::I32:
-      Writef("%u%%", static_cast<int32_t>(const_.u32()));
-      break;
-
-    case Type::I64:
-      Writef("%" PRIu64 "&", static_cast<int64_t>(const_.u64()));
-      break;
+// Whether the only writes the function itself makes to the stack pointer are
+// the prologue and epilogues that FindFrameSlots looks for: the stack pointer
+// minus a size, set once into a frame local, and that local plus the same size.
+bool CWriter::HasFrameStackPointerWrites(const Func& func, Index stack_pointer, bool* has_frame) const {
+  auto local_index = [&](const Expr* expr, ExprType type) {
+    if (!expr || expr->type() != type) {
+      return kInvalidIndex;
+    }
+    switch (type) {
+      case ExprType::LocalGet:
+        return func.GetLocalIndex(cast<LocalGetExpr>(expr)->var);
+      case ExprType::LocalSet:
+        return func.GetLocalIndex(cast<LocalSetExpr>(expr)->var);
+      default:
+        return func.GetLocalIndex(cast<LocalTeeExpr>(expr)->var);
+    }
+  };
+  auto is_binary = [](const Expr* expr, Opcode opcode) {
+    return expr && expr->type() == ExprType::Binary && cast<BinaryExpr>(expr)->opcode == opcode;
+  };
+  auto get_const = [](const Expr* expr, uint32_t* value) {
+    if (!expr || expr->type() != ExprType::Const || cast<ConstExpr>(expr)->const_.type() != Type::I32) {
+      return false;
+    }
+    *value = cast<ConstExpr>(expr)->const_.u32();
+    return true;
+  };
+  auto is_stack_pointer = [&](const Expr* expr) {
+    return expr && expr->type() == ExprType::GlobalGet &&
+           module_->GetGlobalIndex(cast<GlobalGetExpr>(expr)->var) == stack_pointer;
+  };
 
-    case Type::F32: {
-      uint32_t f32_bits = const_.f32_bits();
-      // TODO(binji): Share with similar float info in interp.cc and literal.cc
-      if ((f32_bits & 0x7f800000u) == 0x7f800000u) {
-        const char* sign = (f32_bits & 0x80000000) ? "-" : "";
-        uint32_t significand = f32_bits & 0x7fffffu;
-        if (significand == 0) {
-          // Infinity.
-          Writef("%sFloatInf()", sign);
-        } else {
-          // Nan.
-          Writef("FloatNan()");
-        }
-      } else if (f32_bits == 0x80000000) {
-        // Negative zero. Special-cased so it isn't written as -0 below.
-        Writef("-0.0!");
-      } else {
-        Writef("%.9g!", Bitcast<float>(f32_bits));
+  Index frame_local = kInvalidIndex;
+  uint32_t frame_size = 0;
+  std::vector<std::pair<Index, uint32_t>> epilogues;
+  bool ok = true;
+  std::function<void(const ExprList&)> walk = [&](const ExprList& exprs) {
+    std::vector<const Expr*> list;
+    for (const Expr& expr : exprs) {
+      list.push_back(&expr);
+      if (expr.type() == ExprType::Block) {
+        walk(cast<BlockExpr>(&expr)->block.exprs);
+      } else if (expr.type() == ExprType::Loop) {
+        walk(cast<LoopExpr>(&expr)->block.exprs);
+      } else if (expr.type() == ExprType::If) {
+        walk(cast<IfExpr>(&expr)->true_.exprs);
+        walk(cast<IfExpr>(&expr)->false_);
       }
-      break;
     }
-
-    case Type::F64: {
-      uint64_t f64_bits = const_.f64_bits();
-      // TODO(binji): Share with similar float info in interp.cc and literal.cc
-      if ((f64_bits & 0x7ff0000000000000ull) == 0x7ff0000000000000ull) {
-        const char* sign = (f64_bits & 0x8000000000000000ull) ? "-" : "";
-        uint64_t significand = f64_bits & 0xfffffffffffffull;
-        if (significand == 0) {
-          // Infinity.
-          Writef("%sDoubleInf()", sign);
-        } else {
-          // Nan.
-          Writef("DoubleNan()");
-        }
-      } else if (f64_bits == 0x8000000000000000ull) {
-        // Negative zero. Special-cased so it isn't written as -0 below.
-        Writef("-0.0#");
+    for (size_t i = 0; i < list.size(); ++i) {
+      if (list[i]->type() != ExprType::GlobalSet ||
+          module_->GetGlobalIndex(cast<GlobalSetExpr>(list[i])->var) != stack_pointer) {
+        continue;
+      }
+      auto at = [&](size_t back) { return back <= i ? list[i - back] : nullptr; };
+      uint32_t size = 0;
+      Index local = local_index(at(1), ExprType::LocalTee);
+      size_t sub = 2;
+      if (local == kInvalidIndex) {
+        local = local_index(at(1), ExprType::LocalGet);
+        sub = local != kInvalidIndex && local_index(at(2), ExprType::LocalSet) == local ? 3 : 0;
+      }
+      if (sub != 0 && is_binary(at(sub), Opcode::I32Sub) && get_const(at(sub + 1), &size) &&
+          is_stack_pointer(at(sub + 2)) && frame_local == kInvalidIndex) {
+        frame_local = local;
+        frame_size = size;
+      } else if (is_binary(at(1), Opcode::I32Add) && get_const(at(2), &size) &&
+                 (local = local_index(at(3), ExprType::LocalGet)) != kInvalidIndex) {
+        epilogues.emplace_back(local, size);
       } else {
-        Writef("%.17g#", Bitcast<double>(f64_bits));
+        ok = false;
       }
-      break;
     }
+  };
+  walk(func.exprs);
 
-    default:
-      BRS_UNREACHABLE;
+  *has_frame = frame_local != kInvalidIndex;
+  if (!ok || (*has_frame && (epilogues.empty() || frame_local < func.GetNumParams()))) {
+    return false;
+  }
+  for (const auto& epilogue : epilogues) {
+    if (epilogue.first != frame_local || epilogue.second != frame_size) {
+      return false;
+    }
   }
+  // The frame local must still hold the new frame at every epilogue.
+  size_t frame_local_sets = 0;
+  ForEachExpr(func.exprs, [&](const Expr& expr) {
+    if (local_index(&expr, ExprType::LocalSet) == frame_local ||
+        local_index(&expr, ExprType::LocalTee) == frame_local) {
+      ++frame_local_sets;
+    }
+  });
+  return !*has_frame || frame_local_sets == 1;
 }
 
-void CWriter::WriteInitExpr(const ExprList& expr_list) {
-  if (expr_list.empty())
+void CWriter::FindFrameSlots(const Func& func) {
+  frame_slot_exprs_.clear();
+  frame_slots_.clear();
+  if (module_->memories.empty()) {
     return;
+  }
 
-  assert(expr_list.size() == 1);
-  const Expr* expr = &expr_list.front();
-  switch (expr_list.front().type()) {
-    case ExprType::Const:
-      Write(cast<ConstExpr>(expr)->const_);
-      break;
+  FrameWalk walk;
+  walk.stack_pointer = FindStackPointer();
+  std::vector<FrameValue> stack;
+  if (walk.stack_pointer == kInvalidIndex || !WalkFrameSlots(func.exprs, &stack, &walk) ||
+      walk.frame_local == kInvalidIndex || walk.read_locals.count(walk.frame_local) != 0) {
+    return;
+  }
 
-    case ExprType::GlobalGet:
-      Write(GlobalVar(cast<GlobalGetExpr>(expr)->var));
-      break;
+  // A slot is promoted when every access that touches its bytes reads or
+  // writes exactly that value.
+  auto overlaps = [](const FrameAccess& a, const FrameAccess& b) {
+    return a.address < b.address + b.size && b.address < a.address + a.size;
+  };
+  std::map<uint32_t, Type> slots;
+  for (const FrameAccess& access : walk.accesses) {
+    bool promotable = access.exact;
+    for (const FrameAccess& other : walk.accesses) {
+      if (overlaps(access, other) && (!other.exact || other.address != access.address || other.type != access.type)) {
+        promotable = false;
+        break;
+      }
+    }
+    if (promotable) {
+      slots.emplace(access.address, access.type);
+    }
+  }
 
-    default:
-      BRS_UNREACHABLE;
+  // Each slot is another variable, so leave room under BrightScript's limit.
+  const size_t kMaxPromotingVariables = 192;
+  if (func.GetNumParamsAndLocals() + slots.size() >= kMaxPromotingVariables) {
+    return;
+  }
+  std::map<uint32_t, Index> positions;
+  for (const auto& pair : slots) {
+    positions.emplace(pair.first, frame_slots_.size());
+    frame_slots_.push_back(DefineLocalScopeName("$frame$" + std::to_string(pair.first)));
+  }
+  for (const FrameAccess& access : walk.accesses) {
+    auto iter = positions.find(access.address);
+    if (iter != positions.end()) {
+      frame_slot_exprs_.emplace(access.expr, iter->second);
+    }
   }
 }
 
-void CWriter::WriteFuncTypes() {
-  Write(Newline());
-  Writef("static u32 func_types[%" PRIzd "];", module_->types.size());
-  Write(Newline(), Newline());
-  Write("static void InitFuncTypes(void) {", Newline());
-  Index func_type_index = 0;
-  for (TypeEntry* type : module_->types) {
-    FuncType* func_type = cast<FuncType>(type);
-    Index num_params = func_type->GetNumParams();
-    Index num_results = func_type->GetNumResults();
-    Write("  func_types[", func_type_index, "] = wasm_rt_register_func_type(",
-          num_params, ", ", num_results);
-    for (Index i = 0; i < num_params; ++i) {
-      Write(", ", TypeEnum(func_type->GetParamType(i)));
+// Returns false if the frame's address may escape, or for anything the
+// analysis doesn't understand.
+bool CWriter::WalkFrameSlots(const ExprList& exprs, std::vector<FrameValue>* stack, FrameWalk* walk) {
+  auto operand = [stack](Index index) -> const FrameValue& {
+    return *(stack->rbegin() + index);
+  };
+  auto is_frame = [](const FrameValue& value) {
+    return value.kind == FrameValue::Kind::StackPointer || value.kind == FrameValue::Kind::NewFrame ||
+           value.kind == FrameValue::Kind::Frame;
+  };
+  // Any other use of the frame address could let it escape.
+  auto pop = [&](size_t count) {
+    assert(count <= stack->size());
+    for (size_t i = 0; i < count; ++i) {
+      if (is_frame(operand(i))) {
+        return false;
+      }
     }
-
-    for (Index i = 0; i < num_results; ++i) {
-      Write(", ", TypeEnum(func_type->GetResultType(i)));
+    stack->resize(stack->size() - count);
+    return true;
+  };
+  auto push_other = [stack](size_t count) {
+    stack->resize(stack->size() + count);
+  };
+  auto any_frame = [&]() {
+    return std::any_of(stack->begin(), stack->end(), is_frame);
+  };
+  auto walk_block = [&](const Block& block, const ExprList& block_exprs) {
+    const size_t mark = stack->size() - block.decl.GetNumParams();
+    if (!WalkFrameSlots(block_exprs, stack, walk)) {
+      return false;
+    }
+    if (std::any_of(stack->begin() + mark, stack->end(), is_frame)) {
+      return false;
     }
+    stack->resize(mark);
+    push_other(block.decl.GetNumResults());
+    return true;
+  };
+  auto access = [&](const Expr& expr, Opcode opcode, uint32_t offset, const FrameValue& address) {
+    if (address.kind != FrameValue::Kind::Frame) {
+      return !is_frame(address);
+    }
+    const Type type = expr.type() == ExprType::Load ? opcode.GetResultType() : opcode.GetParamType2();
+    const uint32_t size = opcode.GetMemorySize();
+    const bool exact = ((type == Type::I32 || type == Type::F32) && size == 4) ||
+                       ((type == Type::I64 || type == Type::F64) && size == 8);
+    walk->accesses.push_back({&expr, address.value + offset, type, size, exact});
+    return true;
+  };
 
-    Write(")", Newline());
-    ++func_type_index;
-  }
-  Write("}", Newline());
-}
+  for (const Expr& expr : exprs) {
+    FrameValue result;
+    switch (expr.type()) {
+      case ExprType::Const: {
+        const Const& const_ = cast<ConstExpr>(&expr)->const_;
+        if (const_.type() == Type::I32) {
+          result.kind = FrameValue::Kind::Const;
+          result.value = const_.u32();
+        }
+        stack->push_back(result);
+        break;
+      }
 
-void CWriter::WriteImports() {
-  if (module_->imports.empty())
-    return;
+      case ExprType::GlobalGet:
+        if (module_->GetGlobalIndex(cast<GlobalGetExpr>(&expr)->var) == walk->stack_pointer) {
+          result.kind = FrameValue::Kind::StackPointer;
+        }
+        stack->push_back(result);
+        break;
 
-  // TODO(binji): Write imports ordered by type.
-  for (const Import* import : module_->imports) {
-    const std::string legal_module_name = LegalizeNameNoAddons(import->module_name);
-    Write("' import: '", import->module_name, "' '", import->field_name, "'", Newline());
-    Write("' ");
-    switch (import->kind()) {
-      case ExternalKind::Func: {
-        const Func& func = cast<FuncImport>(import)->func;
-        WriteFuncDeclaration(
-            func.decl,
-            DefineImportName(
-                func.name, import->module_name,
-                LegalizeName("", legal_module_name, import->field_name)));
+      case ExprType::GlobalSet:
+        // Only the prologue and epilogue move the stack pointer to the frame.
+        if (is_frame(operand(0)) &&
+            module_->GetGlobalIndex(cast<GlobalSetExpr>(&expr)->var) != walk->stack_pointer) {
+          return false;
+        }
+        stack->pop_back();
+        break;
+
+      case ExprType::LocalGet: {
+        const Index local = func_->GetLocalIndex(cast<LocalGetExpr>(&expr)->var);
+        if (local == walk->frame_local) {
+          result.kind = FrameValue::Kind::Frame;
+        } else if (walk->frame_local == kInvalidIndex) {
+          walk->read_locals.insert(local);
+        }
+        stack->push_back(result);
+        break;
+      }
+
+      case ExprType::LocalSet:
+      case ExprType::LocalTee: {
+        const Index local = func_->GetLocalIndex(expr.type() == ExprType::LocalSet
+                                                     ? cast<LocalSetExpr>(&expr)->var
+                                                     : cast<LocalTeeExpr>(&expr)->var);
+        // The frame local is set once, from the new frame.
+        if (operand(0).kind == FrameValue::Kind::NewFrame && walk->frame_local == kInvalidIndex) {
+          walk->frame_local = local;
+        } else if (is_frame(operand(0)) || local == walk->frame_local) {
+          return false;
+        }
+        stack->pop_back();
+        if (expr.type() == ExprType::LocalTee) {
+          result.kind = local == walk->frame_local ? FrameValue::Kind::Frame : FrameValue::Kind::Other;
+          stack->push_back(result);
+        }
+        break;
+      }
+
+      case ExprType::Binary: {
+        const Opcode opcode = cast<BinaryExpr>(&expr)->opcode;
+        const FrameValue& lhs = operand(1);
+        const FrameValue& rhs = operand(0);
+        if (opcode == Opcode::I32Sub && lhs.kind == FrameValue::Kind::StackPointer && rhs.kind == FrameValue::Kind::Const) {
+          result.kind = FrameValue::Kind::NewFrame;
+        } else if (opcode == Opcode::I32Add && lhs.kind == FrameValue::Kind::Frame && rhs.kind == FrameValue::Kind::Const) {
+          result.kind = FrameValue::Kind::Frame;
+          result.value = lhs.value + rhs.value;
+        } else if (opcode == Opcode::I32Add && lhs.kind == FrameValue::Kind::Const && rhs.kind == FrameValue::Kind::Frame) {
+          result.kind = FrameValue::Kind::Frame;
+          result.value = lhs.value + rhs.value;
+        } else if (is_frame(lhs) || is_frame(rhs)) {
+          return false;
+        }
+        stack->resize(stack->size() - 2);
+        stack->push_back(result);
+        break;
+      }
+
+      case ExprType::Load: {
+        const LoadExpr* load = cast<LoadExpr>(&expr);
+        if (!access(expr, load->opcode, load->offset, operand(0))) {
+          return false;
+        }
+        stack->pop_back();
+        push_other(1);
+        break;
+      }
+
+      case ExprType::Store: {
+        const StoreExpr* store = cast<StoreExpr>(&expr);
+        if (is_frame(operand(0)) || !access(expr, store->opcode, store->offset, operand(1))) {
+          return false;
+        }
+        stack->resize(stack->size() - 2);
+        break;
+      }
+
+      case ExprType::Compare:
+      case ExprType::Select:
+      case ExprType::Convert:
+      case ExprType::Unary:
+      case ExprType::Drop:
+      case ExprType::MemoryGrow:
+      case ExprType::MemorySize:
+      case ExprType::MemoryCopy:
+      case ExprType::MemoryFill:
+      case ExprType::MemoryInit:
+      case ExprType::DataDrop: {
+        const size_t pops = expr.type() == ExprType::Compare ? 2 :
+                            expr.type() == ExprType::Select ? 3 :
+                            expr.type() == ExprType::Convert || expr.type() == ExprType::Unary ? 1 :
+                            expr.type() == ExprType::Drop || expr.type() == ExprType::MemoryGrow ? 1 :
+                            expr.type() == ExprType::MemorySize || expr.type() == ExprType::DataDrop ? 0 :
+                            3;
+        const size_t pushes = expr.type() == ExprType::Drop || expr.type() == ExprType::MemoryCopy ||
+                              expr.type() == ExprType::MemoryFill || expr.type() == ExprType::MemoryInit ||
+                              expr.type() == ExprType::DataDrop ? 0 : 1;
+        if (!pop(pops)) {
+          return false;
+        }
+        push_other(pushes);
+        break;
+      }
+
+      case ExprType::Call: {
+        const Func* callee = module_->GetFunc(cast<CallExpr>(&expr)->var);
+        if (!pop(callee->GetNumParams())) {
+          return false;
+        }
+        push_other(callee->GetNumResults());
         break;
       }
 
-      case ExternalKind::Global: {
-        const Global& global = cast<GlobalImport>(import)->global;
-        WriteGlobal(global,
-                    DefineImportName(
-                        global.name, import->module_name,
-                        LegalizeName("m.", legal_module_name, import->field_name)));
+      case ExprType::CallIndirect: {
+        const FuncDeclaration& decl = cast<CallIndirectExpr>(&expr)->decl;
+        if (!pop(decl.GetNumParams() + 1)) {
+          return false;
+        }
+        push_other(decl.GetNumResults());
         break;
       }
 
-      case ExternalKind::Memory: {
-        const Memory& memory = cast<MemoryImport>(import)->memory;
-        WriteMemory(DefineImportName(memory.name, import->module_name,
-                                     LegalizeName("m.", legal_module_name, import->field_name)));
+      case ExprType::Block: {
+        const Block& block = cast<BlockExpr>(&expr)->block;
+        if (!walk_block(block, block.exprs)) {
+          return false;
+        }
         break;
       }
 
-      case ExternalKind::Table: {
-        const Table& table = cast<TableImport>(import)->table;
-        WriteTable(DefineImportName(table.name, import->module_name,
-                                    LegalizeName("m.", legal_module_name, import->field_name)));
+      case ExprType::Loop: {
+        const Block& block = cast<LoopExpr>(&expr)->block;
+        if (!walk_block(block, block.exprs)) {
+          return false;
+        }
         break;
       }
 
-      default:
-        BRS_UNREACHABLE;
-    }
+      case ExprType::If: {
+        const IfExpr& if_ = *cast<IfExpr>(&expr);
+        if (!pop(1)) {
+          return false;
+        }
+        const std::vector<FrameValue> entry = *stack;
+        if (!walk_block(if_.true_, if_.true_.exprs)) {
+          return false;
+        }
+        *stack = entry;
+        if (!walk_block(if_.true_, if_.false_)) {
+          return false;
+        }
+        break;
+      }
 
-    Write(Newline());
-  }
-  EndChunk();
-}
+      case ExprType::BrIf:
+        if (any_frame()) {
+          return false;
+        }
+        stack->pop_back();
+        break;
 
-void CWriter::DefineFuncDeclarations() {
-  if (module_->funcs.size() == module_->num_func_imports)
-    return;
+      case ExprType::Nop:
+        break;
 
-  Index func_index = 0;
-  for (const Func* func : module_->funcs) {
-    bool is_import = func_index < module_->num_func_imports;
-    if (!is_import) {
-      DefineGlobalScopeName(func->name);
+      case ExprType::Br:
+      case ExprType::BrTable:
+      case ExprType::Return:
+      case ExprType::Unreachable:
+        // The rest of the list is unreachable, but the frame must not leave
+        // with a branch.
+        return !any_frame();
+
+      default:
+        return false;
     }
-    ++func_index;
   }
+  return true;
 }
 
-void CWriter::WriteFuncDeclaration(const FuncDeclaration& decl,
-                                   const std::string& name) {
-  Write("Function ", name, "(");
-  for (Index i = 0; i < decl.GetNumParams(); ++i) {
-    if (i != 0)
-      Write(", ");
-    Write("p" + std::to_string(i), " As ", decl.GetParamType(i));
-  }
-  Write(") As ", ResultType(decl.sig.result_types));
+void CWriter::WriteResultSlot(Index result_index) {
+  Write("m.", options_.name_prefix, "_result", result_index, "__");
 }
 
-void CWriter::WriteGlobals() {
-  Index global_index = 0;
-  if (module_->globals.size() != module_->num_global_imports) {
-    for (const Global* global : module_->globals) {
-      bool is_import = global_index < module_->num_global_imports;
-      if (!is_import) {
-        DefineGlobalScopeName(global->name, "m.");
-      }
-      ++global_index;
-    }
-  }
+const Func* CWriter::GetFoldedFunc(Index func_index) const {
+  return module_->funcs[folded_funcs_[func_index]];
+}
 
-  Write("Function ", options_.name_prefix, "_InitGlobals__()", OpenBrace());
-  global_index = 0;
-  for (const Global* global : module_->globals) {
-    bool is_import = global_index < module_->num_global_imports;
-    if (!is_import) {
-      assert(!global->init_expr.empty());
-      Write(GlobalName(global->name), " = ");
-      WriteInitExpr(global->init_expr);
-      Write(Newline());
+void CWriter::WriteFuncs() {
+  folded_funcs_.resize(module_->funcs.size());
+  std::vector<bool> foldable(module_->funcs.size(), true);
+  for (Index func_index = 0; func_index < module_->funcs.size(); ++func_index) {
+    folded_funcs_[func_index] = func_index;
+    if (IsFuncNamed(module_->funcs[func_index], options_.keep)) {
+      foldable[func_index] = false;
     }
-    ++global_index;
   }
-  Write(CloseBrace(), "End Function");
-  EndChunk();
-}
-
-void CWriter::WriteGlobal(const Global& global, const std::string& name) {
-  Write(global.type, " ", name);
-}
-
-void CWriter::DefineMemories() {
-  if (module_->memories.size() == module_->num_memory_imports)
-    return;
-
-  assert(module_->memories.size() <= 1);
-  Index memory_index = 0;
-  for (const Memory* memory : module_->memories) {
-    bool is_import = memory_index < module_->num_memory_imports;
-    if (!is_import) {
-      DefineGlobalScopeName(memory->name, "m.");
+  // Exported and start functions are referred to by name outside of the code
+  // that we redirect, so they always keep their own copy.
+  for (const Export* export_ : module_->exports) {
+    if (export_->kind == ExternalKind::Func) {
+      foldable[module_->GetFuncIndex(export_->var)] = false;
     }
-    ++memory_index;
   }
-}
-
-void CWriter::WriteMemory(const std::string& name) {
-  Write("Function ", name, " As Object");
-}
+  for (const Var* var : module_->starts) {
+    foldable[module_->GetFuncIndex(*var)] = false;
+  }
 
-void CWriter::DefineTables() {
-  if (module_->tables.size() == module_->num_table_imports)
-    return;
+  // Functions whose code is identical apart from their own name are written
+  // once, and calls and table entries use that copy instead.
+  std::vector<std::string> func_chunks(module_->funcs.size());
+  std::map<std::string, Index> canonical_funcs;
+  bool any_folded = false;
+  for (Index func_index = module_->num_func_imports; func_index < module_->funcs.size(); ++func_index) {
+    if (!reachable_funcs_[func_index]) {
+      continue;
+    }
+    const Func* func = module_->funcs[func_index];
+    const size_t num_chunks = chunks_.size();
+    cold_func_ = options_.lazy && !hot_funcs_[func_index];
+    Write(*func);
+    cold_func_ = false;
+    if (chunks_.size() == num_chunks) {
+      continue;
+    }
+    func_chunks[func_index] = std::move(chunks_.back());
+    chunks_.pop_back();
 
-  assert(module_->tables.size() <= 1);
-  Index table_index = 0;
-  for (const Table* table : module_->tables) {
-    bool is_import = table_index < module_->num_table_imports;
-    if (!is_import) {
-      DefineGlobalScopeName(table->name, "m.");
+    std::string code = func_chunks[func_index];
+    const std::string header = "Function " + GetGlobalName(func->name) + "(";
+    if (code.compare(0, header.size(), header) == 0) {
+      code.erase(9, header.size() - 10);
+    }
+    auto inserted = canonical_funcs.emplace(std::move(code), func_index);
+    if (!inserted.second && foldable[func_index]) {
+      folded_funcs_[func_index] = inserted.first->second;
+      func_chunks[func_index].clear();
+      any_folded = true;
     }
-    ++table_index;
   }
-}
-
-void CWriter::WriteTable(const std::string& name) {
-  Write("wasm_rt_table_t ", name);
-}
 
-void CWriter::WriteDataInitializers() {
-  const Memory* memory = module_->memories.empty() ? nullptr : module_->memories[0];
-
-  Write("Function ", options_.name_prefix, "_InitMemory__()", OpenBrace());
-  if (memory && module_->num_memory_imports == 0) {
-    uint32_t max =
-        memory->page_limits.has_max ? memory->page_limits.max : 65536;
-    Write(ExternalPtr(memory->name), " = CreateObject(\"roByteArray\")", Newline());
-    Write(ExternalPtr(memory->name), "[", memory->page_limits.initial * WABT_PAGE_SIZE, "] = 0", Newline());
-    Write(ExternalPtr(memory->name), "Max = ", max, Newline());
+  // Callers written before a function was folded still use its old name,
+  // including call_indirect written as direct calls to table entries.
+  bool table_folded = false;
+  for (Index func_index : table_entries_) {
+    table_folded |= func_index != kInvalidIndex && folded_funcs_[func_index] != func_index;
   }
+  for (Index func_index = module_->num_func_imports; func_index < module_->funcs.size(); ++func_index) {
+    if (func_chunks[func_index].empty()) {
+      continue;
+    }
+    const Func* func = module_->funcs[func_index];
+    bool calls_folded = false;
+    if (any_folded) {
+      ForEachExpr(func->exprs, [&](const Expr& expr) {
+        const Var* callee = expr.type() == ExprType::Call ? &cast<CallExpr>(&expr)->var :
+                            expr.type() == ExprType::ReturnCall ? &cast<ReturnCallExpr>(&expr)->var :
+                            nullptr;
+        if (callee) {
+          const Index callee_index = module_->GetFuncIndex(*callee);
+          calls_folded |= folded_funcs_[callee_index] != callee_index;
+        } else if (expr.type() == ExprType::CallIndirect || expr.type() == ExprType::ReturnCallIndirect) {
+          calls_folded |= table_folded;
+        }
+      });
+    }
+    if (calls_folded) {
+      cold_func_ = options_.lazy && !hot_funcs_[func_index];
+      Write(*func);
+      cold_func_ = false;
+      func_chunks[func_index] = std::move(chunks_.back());
+      chunks_.pop_back();
+    }
 
-  if (!module_->data_segments.empty()) {
-    Write("segment = CreateObject(\"roByteArray\")", Newline());
+    if (options_.lazy && !hot_funcs_[func_index]) {
+      WriteLazyFunc(*func, std::move(func_chunks[func_index]));
+    } else {
+      chunks_.push_back(std::move(func_chunks[func_index]));
+    }
   }
 
-  Index data_segment_index = 0;
-  for (const DataSegment* data_segment : module_->data_segments) {
-    Write("segment.FromHexString(\"");
-    for (uint8_t x : data_segment->data) {
-      Writef("%02x", x);
+  for (Index func_index = 0; func_index < module_->funcs.size(); ++func_index) {
+    for (const Specialization& specialization : specializations_[func_index]) {
+      specialization_ = &specialization;
+      Write(*module_->funcs[func_index]);
+      specialization_ = nullptr;
     }
-    Write("\")", Newline());
-
-    Write("MemoryCopy(", ExternalRef(memory->name), ", ");
-    WriteInitExpr(data_segment->offset);
-    Write(", segment, 0, ", data_segment->data.size(), ")", Newline());
-    ++data_segment_index;
   }
 
-  Write(CloseBrace(), "End Function");
-  EndChunk();
+  if (!lazy_groups_.empty()) {
+    WriteLazyLoader();
+  }
 }
 
-void CWriter::WriteElemInitializers() {
-  const Table* table = module_->tables.empty() ? nullptr : module_->tables[0];
-
-  Write("Function ", options_.name_prefix, "_InitTable__()", OpenBrace());
-  if (table && module_->num_table_imports == 0) {
-    uint32_t max =
-        table->elem_limits.has_max ? table->elem_limits.max : UINT32_MAX;
-    Write(ExternalPtr(table->name), " = []", Newline());
+void CWriter::WriteLazyFunc(const Func& func, std::string code) {
+  // Cold functions go into scripts of at most this size, which are compiled
+  // on the first call into them.
+  const size_t kLazyGroupSize = 1024 * 256;
+  if (lazy_groups_.empty() || lazy_groups_.back().size() + code.size() > kLazyGroupSize) {
+    lazy_groups_.emplace_back();
+    lazy_group_funcs_.emplace_back();
   }
-  for (const ElemSegment* elem_segment : module_->elem_segments) {
-    Write("offset = ");
-    WriteInitExpr(elem_segment->offset);
-    Write(Newline());
 
-    size_t i = 0;
-    for (const ElemExpr& elem_expr : elem_segment->elem_exprs) {
-      // We don't support the bulk-memory proposal here, so we know that we
-      // don't have any passive segments (where ref.null can be used).
-      assert(elem_expr.kind == ElemExprKind::RefFunc);
-      const Func* func = module_->GetFunc(elem_expr.var);
-      Index func_type_index = module_->GetFuncTypeIndex(func->decl.type_var);
+  // The real function is renamed, and a stub with its name loads the script.
+  const std::string name = GetGlobalName(func.name);
+  const std::string lazy_name = name + "__lazy";
+  const std::string header = "Function " + name + "(";
+  assert(code.compare(0, header.size(), header) == 0);
+  code.insert(9 + name.size(), "__lazy");
+  lazy_groups_.back() += code;
+  lazy_groups_.back() += "\n";
+  lazy_group_funcs_.back().push_back(lazy_name);
 
-      Write(ExternalRef(table->name), "[offset + ", i, "] = ", ExternalPtr(func->name), Newline());
-      ++i;
+  Write("Function ", name, "(");
+  for (Index i = 0; i < func.GetNumParams(); ++i) {
+    if (i != 0) {
+      Write(", ");
     }
+    Write("p", i, " As ", func.GetParamType(i));
   }
-
+  if (func.GetNumResults() > 1 && !ReturnsResultArray(func)) {
+    // The other results are left in their slots by the real function.
+    Write(") As ", func.GetResultType(0), OpenBrace());
+  } else {
+    Write(") As ", ResultType(func.decl.sig.result_types), OpenBrace());
+  }
+  // Once the script is loaded its functions are on m, so later calls skip the
+  // loader. Calling them as members of m also makes them see this m.
+  Write("If m.", lazy_name, " = invalid Then ", options_.name_prefix, "_LoadLazyGroup__(",
+        Index(lazy_groups_.size() - 1), ")", Newline());
+  if (func.GetNumResults() != 0) {
+    Write("Return ");
+  }
+  Write("m.", lazy_name, "(");
+  for (Index i = 0; i < func.GetNumParams(); ++i) {
+    if (i != 0) {
+      Write(", ");
+    }
+    Write("p", i);
+  }
+  Write(")", Newline());
   Write(CloseBrace(), "End Function");
   EndChunk();
 }
 
-void CWriter::WriteInitExports() {
-  Write("Function ", options_.name_prefix, "_InitExports__()", OpenBrace());
-  WriteExports();
-  Write(CloseBrace(), "End Function", Newline());
-
-  // Here we only export functions since they are global and not done with m.something
-  for (const Export* export_ : module_->exports) {
-    if (export_->kind != ExternalKind::Func) {
-      continue;
-    }
-    const Func* func = module_->GetFunc(export_->var);
-    const std::string mangled_name = LegalizeName("", options_.name_prefix, export_->name);
-
-    // If the name is the same as the export, don't bother wrapping it
-    if (mangled_name == GetGlobalName(func->name)) {
-      continue;
-    }
+// BrightScript keywords and built in functions, which are called by name in
+// any script.
+static const char* const s_brightscript_builtins[] = {
+  "and", "else", "elseif", "exit", "for", "function", "goto", "if", "mod", "not", "or", "print", "return",
+  "step", "sub", "then", "throw", "to", "while", "abs", "asc", "atn", "box", "cdbl", "chr", "cint", "cos",
+  "createobject", "csng", "eval", "exp", "fix", "getglobalaa", "getinterface", "instr", "int", "lcase",
+  "left", "len", "log", "mid", "right", "rnd", "run", "sgn", "sin", "sleep", "sqr", "str", "stri", "tan",
+  "type", "ucase", "val", "wait",
+};
 
-    Write("' export: '", options_.name_prefix, "' '", module_->name, "' '", export_->name, "'", Newline());
-    Write("Function ", mangled_name, "(");
-    for (Index i = 0; i < func->GetNumParams(); ++i) {
-      if (i != 0) {
-        Write(", ");
+// Rewrites the calls in a lazy script to go through m: calls between its own
+// functions go straight to the real function, and every other function it
+// calls is added to outside_funcs. Calling a member of m gives the callee the
+// channel's m, and the functions compiled at launch are found without relying
+// on Run() sharing them. Names are only matched as whole identifiers followed
+// by a call, outside of strings and comments.
+static std::string RedirectLazyCalls(const std::string& code,
+                                     const std::set<std::string>& names,
+                                     std::set<std::string>* outside_funcs) {
+  auto is_identifier = [](char c) {
+    return isalnum(static_cast<unsigned char>(c)) || c == '_';
+  };
+  auto is_builtin = [](std::string word) {
+    std::transform(word.begin(), word.end(), word.begin(), [](unsigned char c) { return tolower(c); });
+    return std::find_if(std::begin(s_brightscript_builtins), std::end(s_brightscript_builtins),
+                        [&word](const char* builtin) { return word == builtin; }) != std::end(s_brightscript_builtins);
+  };
+  std::string result;
+  result.reserve(code.size());
+  std::string previous_word;
+  size_t i = 0;
+  while (i < code.size()) {
+    const char c = code[i];
+    if (c == '"' || c == '\'') {
+      const size_t end = code.find(c == '"' ? '"' : '\n', i + 1);
+      const size_t next = end == std::string::npos ? code.size() : end + 1;
+      result.append(code, i, next - i);
+      i = next;
+    } else if (is_identifier(c)) {
+      size_t end = i;
+      while (end < code.size() && is_identifier(code[end])) {
+        ++end;
       }
-      Write("p", i, " As ", func->GetParamType(i));
-    }
-    Write(")", OpenBrace());
-
-    Write("Return ", ExternalPtr(func->name), "(");
-    for (Index i = 0; i < func->GetNumParams(); ++i) {
-      if (i != 0) {
-        Write(", ");
+      const std::string word = code.substr(i, end - i);
+      // Skip member calls, numbers, function headers and builtins.
+      const bool is_call = end < code.size() && code[end] == '(' && (result.empty() || result.back() != '.') &&
+                           !isdigit(static_cast<unsigned char>(c)) && previous_word != "Function" && !is_builtin(word);
+      if (is_call && names.count(word) != 0) {
+        result += "m." + word + "__lazy";
+      } else if (is_call) {
+        result += "m." + word;
+        outside_funcs->insert(word);
+      } else {
+        result += word;
       }
-      Write("p", i);
+      previous_word = word;
+      i = end;
+    } else {
+      result += c;
+      ++i;
     }
-    Write(")", Newline());
-
-    Write(CloseBrace(), "End Function", Newline());
   }
-  EndChunk();
+  return result;
 }
 
-void CWriter::WriteExports() {
-  for (const Export* export_ : module_->exports) {
-    if (export_->kind == ExternalKind::Func) {
-      continue;
+void CWriter::WriteLazyLoader() {
+  // The scripts only reach functions outside of themselves through m, so
+  // they don't depend on what Run() shares with the channel.
+  std::set<std::string> outside_funcs;
+  for (size_t group = 0; group < lazy_groups_.size(); ++group) {
+    std::set<std::string> names;
+    for (const std::string& name : lazy_group_funcs_[group]) {
+      names.insert(name.substr(0, name.size() - strlen("__lazy")));
     }
+    lazy_groups_[group] = RedirectLazyCalls(lazy_groups_[group], names, &outside_funcs);
+  }
 
-    Write("' export: '", options_.name_prefix, "' '", module_->name, "' '", export_->name, "'", Newline());
-    const std::string mangled_name = LegalizeName("m.", options_.name_prefix, export_->name);
-    std::string internal_name;
-
-    switch (export_->kind) {
-      case ExternalKind::Global: {
-        const Global* global = module_->GetGlobal(export_->var);
-        internal_name = global->name;
-        break;
-      }
-
-      case ExternalKind::Memory: {
-        const Memory* memory = module_->GetMemory(export_->var);
-        internal_name = memory->name;
-        break;
-      }
-
-      case ExternalKind::Table: {
-        const Table* table = module_->GetTable(export_->var);
-        internal_name = table->name;
-        break;
-      }
+  const std::string filename = GetSidecarFilename("_lazy");
+  const std::string path = options_.lazy_dir + filename.substr(filename.find_last_of("/") + 1);
+  Write("Function ", options_.name_prefix, "_LoadLazyGroup__(group as Integer)", OpenBrace());
+  Write("If m.", options_.name_prefix, "_lazy__ = invalid Then", OpenBrace());
+  Write("m.", options_.name_prefix, "_lazy__ = True", Newline());
+  for (const std::string& name : outside_funcs) {
+    Write("m.", name, " = ", name, Newline());
+  }
+  Write(CloseBrace(), "End If", Newline());
+  Write("funcs = Run(\"", path, "\" + group.ToStr() + \".brs\")", Newline());
+  Write("If funcs = invalid Then", OpenBrace());
+  Write("Throw \"Unable to load ", path, "\" + group.ToStr() + \".brs\"", Newline());
+  Write(CloseBrace(), "End If", Newline());
+  Write("m.Append(funcs)", Newline());
+  Write(CloseBrace(), "End Function");
+  EndChunk();
+}
 
-      default:
-        BRS_UNREACHABLE;
+void CWriter::WriteLazyGroups() {
+  for (size_t group = 0;; ++group) {
+    if (remove(GetLazyGroupFilename(group).c_str()) != 0) {
+      break;
     }
+  }
 
-    Write(mangled_name, " = ", ExternalPtr(internal_name), Newline());
+  for (size_t group = 0; group < lazy_groups_.size(); ++group) {
+    // Run() calls Main, which hands back the functions in the script.
+    std::string code = lazy_groups_[group];
+    code += "Function Main() As Object\n";
+    code += "Return {\n";
+    for (const std::string& name : lazy_group_funcs_[group]) {
+      code += "\"" + name + "\": " + name + "\n";
+    }
+    code += "}\nEnd Function\n";
+
+    FileStream file(GetLazyGroupFilename(group).c_str());
+    file.WriteData(code.data(), code.size());
   }
 }
 
-void CWriter::WriteInit() {
-  Write("Function ", options_.name_prefix, "Init__()", OpenBrace());
-  //Write("InitFuncTypes()", Newline());
-  Write(options_.name_prefix, "_InitGlobals__()", Newline());
-  Write(options_.name_prefix, "_InitMemory__()", Newline());
-  Write(options_.name_prefix, "_InitTable__()", Newline());
-  Write(options_.name_prefix, "_InitExports__()", Newline());
-  for (Var* var : module_->starts) {
-    Write(ExternalRef(module_->GetFunc(*var)->name), "()", Newline());
-  }
-  Write(CloseBrace(), "End Function");
-  EndChunk();
+std::string CWriter::GetLazyGroupFilename(size_t group) {
+  return GetSidecarFilename("_lazy") + std::to_string(group) + ".brs";
 }
 
-void CWriter::WriteFuncs() {
-  Index func_index = 0;
-  for (const Func* func : module_->funcs) {
-    bool is_import = func_index < module_->num_func_imports;
-    if (!is_import) {
-      DefineGlobalScopeName(func->name);
-      Write(*func);
+void CWriter::WriteReplacedFunc(const Func& func,
+                                const Intrinsic* intrinsic,
+                                const MathIntrinsic* math_intrinsic) {
+  Write("Function ", GlobalName(func.name), "(");
+  for (Index i = 0; i < func.GetNumParams(); ++i) {
+    if (i != 0) {
+      Write(", ");
     }
-    ++func_index;
+    Write("p", i, " As ", func.GetParamType(i));
+  }
+  Write(") As ", func.GetResultType(0), OpenBrace());
+  Write("Return ");
+  if (math_intrinsic) {
+    Write(math_intrinsic->prefix);
+    for (Index i = 0; i < func.GetNumParams(); ++i) {
+      if (i != 0) {
+        Write(math_intrinsic->separator);
+      }
+      Write("p", i);
+    }
+    Write(math_intrinsic->suffix, Newline());
+  } else {
+    Write(intrinsic->runtime_name, "(", ExternalPtr(module_->memories[0]->name));
+    for (Index i = 0; i < func.GetNumParams(); ++i) {
+      Write(", p", i);
+    }
+    Write(")", Newline());
   }
+  Write(CloseBrace(), "End Function");
+  EndChunk();
 }
 
 void CWriter::Write(const Func& func) {
-  if (IsReplaceableMemFunction(func)) {
+  const Intrinsic* intrinsic = FindIntrinsic(*module_, func);
+  const MathIntrinsic* math_intrinsic = FindMathIntrinsic(func);
+  if (intrinsic || math_intrinsic) {
+    // Calls use the runtime routine directly, so a body is only needed where
+    // the function is referred to by name.
+    if (named_funcs_[module_->GetFuncIndex(Var(func.name))]) {
+      WriteReplacedFunc(func, intrinsic, math_intrinsic);
+    }
     return;
   }
 
@@ -1121,40 +3838,93 @@ void CWriter::Write(const Func& func) {
   label_count_ = 0;
   // Copy symbols from global symbol table so we don't shadow them.
   local_syms_ = global_syms_;
+  minified_local_count_ = 0;
   local_sym_map_.clear();
   stack_var_sym_map_.clear();
+  local_info_.clear();
+  read_locals_.clear();
+  CollectReadLocals(func.exprs);
+  ComputeLocalMaxBits(func);
 
-  Write("Function ", GlobalName(func.name), "(");
+  Write("Function ", GlobalName(specialization_ ? specialization_->name : func.name), "(");
 
   std::vector<std::string> index_to_name;
   MakeTypeBindingReverseMapping(func_->GetNumParamsAndLocals(), func_->bindings,
                                 &index_to_name);
   WriteParams(index_to_name);
 
-  Write(") As ", ResultType(func.decl.sig.result_types), OpenBrace());
+  const bool result_slots = func.GetNumResults() > 1 && !ReturnsResultArray(func);
+  if (result_slots) {
+    Write(") As ", func.GetResultType(0), OpenBrace());
+  } else {
+    Write(") As ", ResultType(func.decl.sig.result_types), OpenBrace());
+  }
 
-  if (!module_->memories.empty()) {
+  FindFrameSlots(func);
+  if (!module_->memories.empty() && UsesMemory(func)) {
     assert(module_->memories.size() == 1);
     Memory* memory = module_->memories[0];
     Write("mem = ", ExternalPtr(memory->name), Newline());
   }
 
+  DefineGlobalCaches(func);
+  for (const auto& pair : global_caches_) {
+    Write(pair.second, " = ", GlobalVar(Var(module_->globals[pair.first]->name)), Newline());
+  }
+
+  // Every call_indirect reads the table from m, so several share a local.
+  size_t indirect_calls = 0;
+  ForEachExpr(func.exprs, [&](const Expr& expr) {
+    indirect_calls += expr.type() == ExprType::CallIndirect || expr.type() == ExprType::ReturnCallIndirect;
+  });
+  table_local_.clear();
+  if (indirect_calls > 1) {
+    table_local_ = DefineLocalScopeName("$table$");
+    Write(table_local_, " = ", ExternalRef(module_->tables[0]->name), Newline());
+  }
+
+  // Only what may be read before it is written needs to start as zero.
+  uninitialized_reads_.clear();
+  std::set<Index> params;
+  for (Index i = 0; i < func.GetNumParams(); ++i) {
+    params.insert(i);
+  }
+  CollectUninitializedReads(func.exprs, std::move(params));
+
+  // Self tail calls jump back here, before the locals are zeroed.
+  if (HasSelfTailCall(func.exprs)) {
+    WriteLabelRaw(LabelDecl(DefineLocalScopeName(kFuncEntryLabel)));
+  }
   WriteLocals(index_to_name);
+  for (Index i = 0; i < frame_slots_.size(); ++i) {
+    if (uninitialized_reads_.count(func.GetNumParamsAndLocals() + i) != 0) {
+      Write(frame_slots_[i], " = 0", Newline());
+    }
+  }
 
   std::string label = DefineLocalScopeName(kImplicitFuncLabel);
   ResetTypeStack(0);
   std::string empty;  // Must not be temporary, since address is taken by Label.
   PushLabel(LabelType::Func, empty, func.decl.sig);
-  Write(func.exprs, LabelDecl(label));
+  Write(func.exprs);
+  FlushPendingValues();
+  Write(LabelDecl(label));
   PopLabel();
   ResetTypeStack(0);
   PushTypes(func.decl.sig.result_types);
+  WriteGlobalCacheStores(nullptr);
 
   size_t results = func.decl.sig.result_types.size();
   if (results != 0) {
     // Return the top of the stack implicitly.
     if (results == 1) {
       Write("Return ", StackVar(0), Newline());
+    } else if (result_slots) {
+      for (Index i = 1; i < results; ++i) {
+        WriteResultSlot(i);
+        Write(" = ", StackVar(results - i - 1), Newline());
+      }
+      Write("Return ", StackVar(results - 1), Newline());
     } else {
       Write("Return [");
       for (int i = (int)results - 1; i >= 0; --i) {
@@ -1181,7 +3951,8 @@ void CWriter::Write(const Func& func) {
   }
   label_count_ = 0;
   const size_t variable_limit = 254;
-  const size_t variable_count = func.GetNumParamsAndLocals() + stack_var_sym_map_.size();
+  const size_t variable_count = func.GetNumParamsAndLocals() + stack_var_sym_map_.size() + global_caches_.size() +
+                                frame_slots_.size() + !table_local_.empty() + local_sym_map_.count("$count$");
   if (variable_count > 254) {
     std::cerr << "Function " << func.name << " had " << variable_count << " variables (limit " << variable_limit << " due to BrightScript)" << std::endl;
     BRS_ABORT("Variable limit reached");
@@ -1192,10 +3963,16 @@ void CWriter::Write(const Func& func) {
 
 void CWriter::WriteParams(const std::vector<std::string>& index_to_name) {
   Indent(4);
+  bool first = true;
   for (Index i = 0; i < func_->GetNumParams(); ++i) {
-    if (i != 0) {
+    // Parameters fixed by a specialization are constants instead.
+    if (GetSpecializedParam(i)) {
+      continue;
+    }
+    if (!first) {
       Write(", ");
     }
+    first = false;
     Write(DefineLocalScopeName(index_to_name[i]), " As ", func_->GetParamType(i));
   }
   Dedent(4);
@@ -1208,9 +3985,23 @@ void CWriter::WriteLocals(const std::vector<std::string>& index_to_name) {
     size_t count = 0;
     for (Type local_type : func_->local_types) {
       if (local_type == type) {
-        Write(DefineLocalScopeName(index_to_name[num_params + local_index]),
-              " = 0", Newline());
-        ++count;
+        const Index index = num_params + local_index;
+        std::string name = DefineLocalScopeName(index_to_name[index]);
+        // Locals start as zero, which we can propagate until the first set.
+        StackValueInfo info;
+        info.is_const = true;
+        info.max_bits = 0;
+        info.value = type == Type::I32 ? Const::I32(0) :
+                     type == Type::I64 ? Const::I64(0) :
+                     type == Type::F32 ? Const::F32(0) :
+                                         Const::F64(0);
+        local_info_.emplace(index, info);
+        // Locals that are always written before they are read don't need to
+        // be zeroed.
+        if (uninitialized_reads_.count(index) != 0) {
+          Write(name, " = 0", Newline());
+          ++count;
+        }
       }
       ++local_index;
     }
@@ -1248,8 +4039,319 @@ void CWriter::WriteStackVarDeclarations() {
   }
 }
 
+void CWriter::WriteCall(const Var& var) {
+  const Func& func = *module_->GetFunc(var);
+  Index num_params = func.GetNumParams();
+  Index num_results = func.GetNumResults();
+  assert(type_stack_.size() >= num_params);
+  const Intrinsic* intrinsic = FindIntrinsic(*module_, func);
+  const MathIntrinsic* math_intrinsic = FindMathIntrinsic(func);
+  // A small constant memcpy/memset is written inline, and returns the
+  // destination that is already in the slot of its first argument.
+  if (intrinsic && (strcmp(intrinsic->name, "$memset") == 0 || strcmp(intrinsic->name, "$memcpy") == 0) &&
+      WriteUnrolledMemoryOp(strcmp(intrinsic->name, "$memset") == 0, false)) {
+    DropTypes(2);
+    return;
+  }
+
+  const Index func_index = module_->GetFuncIndex(var);
+  const bool result_array = ReturnsResultArray(*GetFoldedFunc(func_index));
+  const Specialization* specialization =
+      intrinsic || math_intrinsic ? nullptr : FindSpecialization(func_index, num_params);
+  const bool uses_globals = !intrinsic && !math_intrinsic;
+  if (uses_globals) {
+    WriteGlobalCacheStores(&func_global_accesses_[func_index]);
+  }
+  if (num_results > 0) {
+    if (num_results == 1 || !result_array) {
+      Write(StackVar(num_params - 1, func.GetResultType(0)));
+    } else {
+      Write("multi");
+    }
+    Write(" = ");
+  }
+  if (math_intrinsic) {
+    Write(math_intrinsic->prefix);
+    for (Index i = 0; i < num_params; ++i) {
+      if (i != 0) {
+        Write(math_intrinsic->separator);
+      }
+      Write(StackValue(num_params - i - 1));
+    }
+    Write(math_intrinsic->suffix, Newline());
+    DropTypes(num_params);
+    PushTypes(func.decl.sig.result_types);
+    return;
+  }
+  if (intrinsic) {
+    Write(intrinsic->runtime_name);
+  } else if (specialization) {
+    Write(ExternalRef(specialization->name));
+  } else {
+    Write(ExternalRef(GetFoldedFunc(func_index)->name));
+  }
+  Write("(");
+  if (intrinsic) {
+    Write("mem");
+  }
+  bool first = !intrinsic;
+  for (Index i = 0; i < num_params; ++i) {
+    if (specialization && specialization->params.count(i) != 0) {
+      continue;
+    }
+    if (!first) {
+      Write(", ");
+    }
+    first = false;
+    Write(StackValue(num_params - i - 1));
+  }
+  Write(")", Newline());
+  if (uses_globals) {
+    WriteGlobalCacheLoads(func_global_writes_[func_index], stack_pointer_restoring_funcs_[func_index]);
+  }
+  DropTypes(num_params);
+  PushTypes(func.decl.sig.result_types);
+  if (num_results > 1) {
+    for (Index i = result_array ? 0 : 1; i < num_results; ++i) {
+      Write(StackVar(num_results - i - 1, func.GetResultType(i)), " = ");
+      if (result_array) {
+        Write("multi[", i, "]", Newline());
+      } else {
+        WriteResultSlot(i);
+        Write(Newline());
+      }
+    }
+  }
+}
+
+void CWriter::WriteCallIndirect(const FuncDeclaration& decl) {
+  Index num_params = decl.GetNumParams();
+  Index num_results = decl.GetNumResults();
+  assert(type_stack_.size() > num_params);
+
+  assert(module_->tables.size() == 1);
+  const Table* table = module_->tables[0];
+
+  // With the whole table known, a constant index or a signature held by only
+  // a couple of functions is called directly.
+  const Func* constant_target = nullptr;
+  std::vector<std::pair<const Func*, std::vector<Index>>> targets;
+  if (table_known_) {
+    const Const* index = GetStackConst(0);
+    if (index) {
+      if (index->u32() < table_entries_.size() && table_entries_[index->u32()] != kInvalidIndex &&
+          module_->funcs[table_entries_[index->u32()]]->decl.sig == decl.sig) {
+        constant_target = GetFoldedFunc(table_entries_[index->u32()]);
+      }
+    } else {
+      const size_t kMaxTargets = 2;
+      const size_t kMaxCompares = 4;
+      size_t compares = 0;
+      for (Index i = 0; i < table_entries_.size() && compares <= kMaxCompares; ++i) {
+        if (table_entries_[i] == kInvalidIndex || !(module_->funcs[table_entries_[i]]->decl.sig == decl.sig)) {
+          continue;
+        }
+        const Func* func = GetFoldedFunc(table_entries_[i]);
+        auto iter = std::find_if(targets.begin(), targets.end(), [func](const std::pair<const Func*, std::vector<Index>>& target) {
+          return target.first == func;
+        });
+        if (iter == targets.end()) {
+          targets.emplace_back(func, std::vector<Index>());
+          iter = targets.end() - 1;
+        }
+        iter->second.push_back(i);
+        ++compares;
+      }
+      if (targets.size() > kMaxTargets || compares > kMaxCompares) {
+        targets.clear();
+      }
+    }
+  }
+
+  auto write_call = [&](const Func* target) {
+    // Lazy scripts call the entry as a member of m so that it sees the
+    // channel's m.
+    const std::string callee = "m." + options_.name_prefix + "_callee__";
+    if (!target && cold_func_) {
+      Write(callee, " = ");
+      if (!table_local_.empty()) {
+        Write(table_local_, "[", StackValue(0), "]", Newline());
+      } else {
+        Write(ExternalRef(table->name), "[", StackValue(0), "]", Newline());
+      }
+    }
+    if (num_results > 0) {
+      if (num_results == 1 || !table_result_arrays_) {
+        Write(StackVar(num_params, decl.GetResultType(0)));
+      } else {
+        Write("multi");
+      }
+      Write(" = ");
+    }
+    if (target) {
+      Write(ExternalRef(target->name), "(");
+    } else if (cold_func_) {
+      Write(callee, "(");
+    } else if (!table_local_.empty()) {
+      Write(table_local_, "[", StackValue(0), "](");
+    } else {
+      Write(ExternalRef(table->name), "[", StackValue(0), "](");
+    }
+    for (Index i = 0; i < num_params; ++i) {
+      if (i != 0) {
+        Write(", ");
+      }
+      Write(StackValue(num_params - i));
+    }
+    Write(")", Newline());
+  };
+
+  WriteGlobalCacheStores(&table_global_accesses_);
+  if (constant_target) {
+    write_call(constant_target);
+  } else if (!targets.empty()) {
+    // The arguments are used more than once, so compute them first.
+    FlushPendingValues();
+    for (size_t i = 0; i < targets.size(); ++i) {
+      Write(i == 0 ? "If " : "Else If ");
+      for (size_t j = 0; j < targets[i].second.size(); ++j) {
+        if (j != 0) {
+          Write(" Or ");
+        }
+        Write(StackVar(0), " = ", targets[i].second[j]);
+      }
+      Write(" Then", OpenBrace());
+      write_call(targets[i].first);
+      Write(CloseBrace());
+    }
+    // Anything else fails like it did before, e.g. a null entry.
+    Write("Else", OpenBrace());
+    write_call(nullptr);
+    Write(CloseBrace(), "End If", Newline());
+  } else {
+    write_call(nullptr);
+  }
+  WriteGlobalCacheLoads(table_global_writes_, table_restores_stack_pointer_);
+  DropTypes(num_params + 1);
+  PushTypes(decl.sig.result_types);
+  if (num_results > 1) {
+    for (Index i = table_result_arrays_ ? 0 : 1; i < num_results; ++i) {
+      Write(StackVar(num_results - i - 1, decl.GetResultType(i)), " = ");
+      if (table_result_arrays_) {
+        Write("multi[", i, "]", Newline());
+      } else {
+        WriteResultSlot(i);
+        Write(Newline());
+      }
+    }
+  }
+}
+
+bool CWriter::IsSelfTailCall(ExprList::const_iterator iter, const ExprList& exprs) const {
+  const Var* var = iter->type() == ExprType::Call ? &cast<CallExpr>(&*iter)->var :
+                   iter->type() == ExprType::ReturnCall ? &cast<ReturnCallExpr>(&*iter)->var :
+                   nullptr;
+  if (!var || module_->GetFunc(*var) != func_) {
+    return false;
+  }
+  if (iter->type() == ExprType::ReturnCall) {
+    return true;
+  }
+  // A call followed by a return, or at the very end of the function.
+  auto next = std::next(iter);
+  return next == exprs.end() ? &exprs == &func_->exprs : next->type() == ExprType::Return;
+}
+
+bool CWriter::HasSelfTailCall(const ExprList& exprs) const {
+  for (auto iter = exprs.begin(); iter != exprs.end(); ++iter) {
+    if (IsSelfTailCall(iter, exprs)) {
+      return true;
+    }
+    switch (iter->type()) {
+      case ExprType::Block:
+        if (HasSelfTailCall(cast<BlockExpr>(&*iter)->block.exprs)) {
+          return true;
+        }
+        break;
+      case ExprType::Loop:
+        if (HasSelfTailCall(cast<LoopExpr>(&*iter)->block.exprs)) {
+          return true;
+        }
+        break;
+      case ExprType::If: {
+        const IfExpr* if_ = cast<IfExpr>(&*iter);
+        if (HasSelfTailCall(if_->true_.exprs) || HasSelfTailCall(if_->false_)) {
+          return true;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  return false;
+}
+
+// A specialization can only loop back to itself when the call passes the
+// constants it was made for; otherwise it is an ordinary call.
+bool CWriter::PassesSpecializedParams() {
+  if (!specialization_) {
+    return true;
+  }
+  const Index num_params = func_->GetNumParams();
+  for (const auto& pair : specialization_->params) {
+    const Const* arg = GetStackConst(num_params - pair.first - 1);
+    if (!arg || !ConstEquals(*arg, pair.second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void CWriter::WriteSelfTailCall() {
+  // Instead of recursing, reassign the parameters and start over, which also
+  // resets the locals to zero.
+  const Index num_params = func_->GetNumParams();
+  FlushPendingValues();
+  std::vector<std::string> index_to_name;
+  MakeTypeBindingReverseMapping(func_->GetNumParamsAndLocals(), func_->bindings, &index_to_name);
+  for (Index i = 0; i < num_params; ++i) {
+    if (!GetSpecializedParam(i)) {
+      Write(LocalName(index_to_name[i]), " = ", StackVar(num_params - i - 1), Newline());
+    }
+  }
+  DropTypes(num_params);
+  local_info_.clear();
+  Write("Goto ", Var(kFuncEntryLabel), Newline());
+  DiscardPendingValues();
+}
+
+void CWriter::WriteReturn() {
+  FlushPendingValues();
+  // Goto the function label instead; this way we can do shared function
+  // cleanup code in one place.
+  Write(GotoLabel(Var(label_stack_.size() - 1)), Newline());
+  DiscardPendingValues();
+}
+
 void CWriter::Write(const ExprList& exprs) {
-  for (const Expr& expr : exprs) {
+  for (auto iter = exprs.begin(); iter != exprs.end(); ++iter) {
+    const Expr& expr = *iter;
+    if (TryFoldExpr(expr)) {
+      continue;
+    }
+
+    if (WriteWideningMulShift(iter, exprs.end())) {
+      // Skip the shift amount, the shift and the wrap.
+      std::advance(iter, 3);
+      continue;
+    }
+
+    // Must be decided before the operands are dropped.
+    const Index max_bits = GetResultMaxBits(expr, [this](Index index) -> const StackValueInfo& {
+      return StackInfo(index);
+    });
+
     switch (expr.type()) {
       case ExprType::Binary:
         Write(*cast<BinaryExpr>(&expr));
@@ -1257,10 +4359,17 @@ void CWriter::Write(const ExprList& exprs) {
 
       case ExprType::Block: {
         const Block& block = cast<BlockExpr>(&expr)->block;
+        FlushPendingValues();
         std::string label = DefineLocalScopeName(block.label);
         size_t mark = MarkTypeStack();
         PushLabel(LabelType::Block, block.label, block.decl.sig);
-        Write(block.exprs, LabelDecl(label));
+        Write(block.exprs);
+        FlushPendingValues();
+        if (IsTopLabelUsed()) {
+          // Branches join here, so we no longer know the values of locals.
+          local_info_.clear();
+        }
+        Write(LabelDecl(label));
         ResetTypeStack(mark);
         PopLabel();
         PushTypes(block.decl.sig.result_types);
@@ -1268,18 +4377,46 @@ void CWriter::Write(const ExprList& exprs) {
       }
 
       case ExprType::Br:
+        FlushPendingValues();
         Write(GotoLabel(cast<BrExpr>(&expr)->var), Newline());
+        DiscardPendingValues();
         // Stop processing this ExprList, since the following are unreachable.
         return;
 
-      case ExprType::BrIf:
+      case ExprType::BrIf: {
+        const Const* condition = GetStackConst(0);
+        if (condition) {
+          DropTypes(1);
+          if (condition->u32() == 0) {
+            break;
+          }
+          // Always taken, so this is just a Br.
+          FlushPendingValues();
+          Write(GotoLabel(cast<BrIfExpr>(&expr)->var), Newline());
+          DiscardPendingValues();
+          return;
+        }
+        FlushPendingValues();
         Write("If ", StackVar(0), " Then", OpenBrace());
         DropTypes(1);
         Write(GotoLabel(cast<BrIfExpr>(&expr)->var), Newline(), CloseBrace(), "End If", Newline());
         break;
+      }
 
       case ExprType::BrTable: {
         const auto* bt_expr = cast<BrTableExpr>(&expr);
+        const Const* index = GetStackConst(0);
+        if (index) {
+          const Var& target = index->u32() < bt_expr->targets.size()
+            ? bt_expr->targets[index->u32()]
+            : bt_expr->default_target;
+          DropTypes(1);
+          FlushPendingValues();
+          Write(GotoLabel(target), Newline());
+          DiscardPendingValues();
+          return;
+        }
+        FlushPendingValues();
         // Reduce the number of If blocks (BrightScript limit) by using range checks
         // e.g. If switch >= 1 And switch <= 10 Then
         // Also better for performance
@@ -1329,106 +4466,31 @@ void CWriter::Write(const ExprList& exprs) {
           }
           Write(GotoLabel(bt_expr->default_target), Newline());
         }
+        DiscardPendingValues();
         // Stop processing this ExprList, since the following are unreachable.
         return;
       }
 
-      case ExprType::Call: {
-        const Var& var = cast<CallExpr>(&expr)->var;
-        const Func& func = *module_->GetFunc(var);
-        Index num_params = func.GetNumParams();
-        Index num_results = func.GetNumResults();
-        assert(type_stack_.size() >= num_params);
-        if (num_results > 0) {
-          if (num_results == 1) {
-            Write(StackVar(num_params - 1, func.GetResultType(0)));
-          } else {
-            Write("multi");
-          }
-          Write(" = ");
-        }
-
-        const bool replaceable_mem_func = IsReplaceableMemFunction(func);
-        if (replaceable_mem_func) {
-          if (func.name == "$memcpy") {
-            Write("MemCpy");
-          } else if (func.name == "$memset") {
-            Write("MemSet");
-          } else {
-            BRS_UNREACHABLE;
-          }
-        } else {
-          Write(GlobalVar(var));
-        }
-        Write("(");
-        if (replaceable_mem_func) {
-          Write("mem");
-        }
-        for (Index i = 0; i < num_params; ++i) {
-          if (i != 0 || replaceable_mem_func) {
-            Write(", ");
-          }
-          Write(StackVar(num_params - i - 1));
-        }
-        Write(")", Newline());
-        DropTypes(num_params);
-        PushTypes(func.decl.sig.result_types);
-        if (num_results > 1) {
-          for (Index i = 0; i < num_results; ++i) {
-            Write(StackVar(num_results - i - 1, func.GetResultType(i)), " = multi[", i, "]", Newline());
-          }
+      case ExprType::Call:
+        if (IsSelfTailCall(iter, exprs) && PassesSpecializedParams()) {
+          WriteSelfTailCall();
+          // Stop processing this ExprList, since the following are unreachable.
+          return;
         }
+        WriteCall(cast<CallExpr>(&expr)->var);
         break;
-      }
-
-      case ExprType::CallIndirect: {
-        const FuncDeclaration& decl = cast<CallIndirectExpr>(&expr)->decl;
-        Index num_params = decl.GetNumParams();
-        Index num_results = decl.GetNumResults();
-        assert(type_stack_.size() > num_params);
-        if (num_results > 0) {
-          if (num_results == 1) {
-            Write(StackVar(num_params, decl.GetResultType(0)));
-          } else {
-            Write("multi");
-          }
-          Write(" = ");
-        }
-
-        assert(module_->tables.size() == 1);
-        const Table* table = module_->tables[0];
 
-        assert(decl.has_func_type);
-        Index func_type_index = module_->GetFuncTypeIndex(decl.type_var);
-
-        Write(ExternalRef(table->name), "[", StackVar(0), "](");
-        for (Index i = 0; i < num_params; ++i) {
-          if (i != 0) {
-            Write(", ");
-          }
-          Write(StackVar(num_params - i));
-        }
-        Write(")", Newline());
-        DropTypes(num_params + 1);
-        PushTypes(decl.sig.result_types);
-        if (num_results > 1) {
-          for (Index i = 0; i < num_results; ++i) {
-            Write(StackVar(num_results - i - 1), " = multi[", i, "]", Newline());
-          }
-        }
+      case ExprType::CallIndirect:
+        WriteCallIndirect(cast<CallIndirectExpr>(&expr)->decl);
         break;
-      }
 
       case ExprType::Compare:
         Write(*cast<CompareExpr>(&expr));
         break;
 
-      case ExprType::Const: {
-        const Const& const_ = cast<ConstExpr>(&expr)->const_;
-        PushType(const_.type());
-        Write(StackVar(0), " = ", const_, Newline());
+      case ExprType::Const:
+        PushConst(cast<ConstExpr>(&expr)->const_);
         break;
-      }
 
       case ExprType::Convert:
         Write(*cast<ConvertExpr>(&expr));
@@ -1441,30 +4503,69 @@ void CWriter::Write(const ExprList& exprs) {
       case ExprType::GlobalGet: {
         const Var& var = cast<GlobalGetExpr>(&expr)->var;
         PushType(module_->GetGlobal(var)->type);
-        Write(StackVar(0), " = ", GlobalVar(var), Newline());
+        auto cache = global_caches_.find(module_->GetGlobalIndex(var));
+        if (cache != global_caches_.end()) {
+          Write(StackVar(0), " = ", cache->second, Newline());
+        } else {
+          Write(StackVar(0), " = ", GlobalVar(var), Newline());
+        }
         break;
       }
 
       case ExprType::GlobalSet: {
         const Var& var = cast<GlobalSetExpr>(&expr)->var;
-        Write(GlobalVar(var), " = ", StackVar(0), Newline());
+        auto cache = global_caches_.find(module_->GetGlobalIndex(var));
+        if (cache != global_caches_.end()) {
+          Write(cache->second, " = ", StackValue(0), Newline());
+        } else {
+          Write(GlobalVar(var), " = ", StackValue(0), Newline());
+        }
         DropTypes(1);
         break;
       }
 
       case ExprType::If: {
         const IfExpr& if_ = *cast<IfExpr>(&expr);
+        const Const* condition = GetStackConst(0);
+        if (condition) {
+          // Only one side can ever run, so write it like a block.
+          const ExprList& taken = condition->u32() != 0 ? if_.true_.exprs : if_.false_;
+          DropTypes(1);
+          FlushPendingValues();
+          std::string label = DefineLocalScopeName(if_.true_.label);
+          size_t mark = MarkTypeStack();
+          PushLabel(LabelType::If, if_.true_.label, if_.true_.decl.sig);
+          Write(taken);
+          FlushPendingValues();
+          if (IsTopLabelUsed()) {
+            local_info_.clear();
+          }
+          Write(LabelDecl(label));
+          ResetTypeStack(mark);
+          PopLabel();
+          PushTypes(if_.true_.decl.sig.result_types);
+          break;
+        }
+
+        FlushPendingValues();
         Write("If ", StackVar(0), " Then", OpenBrace());
         DropTypes(1);
         std::string label = DefineLocalScopeName(if_.true_.label);
         size_t mark = MarkTypeStack();
         PushLabel(LabelType::If, if_.true_.label, if_.true_.decl.sig);
-        Write(if_.true_.exprs, CloseBrace());
+        std::map<Index, StackValueInfo> entry_local_info = local_info_;
+        Write(if_.true_.exprs);
+        FlushPendingValues();
+        Write(CloseBrace());
         if (!if_.false_.empty()) {
           ResetTypeStack(mark);
-          Write("Else", OpenBrace(), if_.false_, CloseBrace());
+          local_info_ = entry_local_info;
+          Write("Else", OpenBrace(), if_.false_);
+          FlushPendingValues();
+          Write(CloseBrace());
         }
         ResetTypeStack(mark);
+        local_info_.clear();
         Write("End If", Newline(), LabelDecl(label));
         PopLabel();
         PushTypes(if_.true_.decl.sig.result_types);
@@ -1477,32 +4578,58 @@ void CWriter::Write(const ExprList& exprs) {
 
       case ExprType::LocalGet: {
         const Var& var = cast<LocalGetExpr>(&expr)->var;
+        if (const Const* constant = GetSpecializedParam(func_->GetLocalIndex(var))) {
+          PushConst(*constant);
+          break;
+        }
+        auto iter = local_info_.find(func_->GetLocalIndex(var));
+        if (iter != local_info_.end() && iter->second.is_const) {
+          PushConst(iter->second.value);
+          break;
+        }
         PushType(func_->GetLocalType(var));
         Write(StackVar(0), " = ", var, Newline());
+        StackInfo(0).max_bits = local_max_bits_[func_->GetLocalIndex(var)];
+        if (iter != local_info_.end()) {
+          StackInfo(0).max_bits = std::min(StackInfo(0).max_bits, iter->second.max_bits);
+        }
         break;
       }
 
       case ExprType::LocalSet: {
         const Var& var = cast<LocalSetExpr>(&expr)->var;
-        Write(var, " = ", StackVar(0), Newline());
+        if (!IsDeadLocal(var)) {
+          Write(var, " = ", StackValue(0), Newline());
+          SetLocalInfo(var, 0);
+        }
         DropTypes(1);
         break;
       }
 
       case ExprType::LocalTee: {
         const Var& var = cast<LocalTeeExpr>(&expr)->var;
-        Write(var, " = ", StackVar(0), Newline());
+        if (!IsDeadLocal(var)) {
+          Write(var, " = ", StackValue(0), Newline());
+          SetLocalInfo(var, 0);
+        }
         break;
       }
 
       case ExprType::Loop: {
         const Block& block = cast<LoopExpr>(&expr)->block;
+        if (WriteLoopIdiom(block)) {
+          break;
+        }
         if (!block.exprs.empty()) {
+          FlushPendingValues();
+          // The back edge joins here, so we no longer know the values of locals.
+          local_info_.clear();
           WriteLabelRaw(LabelDecl(DefineLocalScopeName(block.label)));
           Indent();
           size_t mark = MarkTypeStack();
           PushLabel(LabelType::Loop, block.label, block.decl.sig);
           Write(Newline(), block.exprs);
+          FlushPendingValues();
           ResetTypeStack(mark);
           PopLabel();
           PushTypes(block.decl.sig.result_types);
@@ -1520,14 +4647,8 @@ void CWriter::Write(const ExprList& exprs) {
       case ExprType::AtomicNotify:
       case ExprType::BrOnExn:
       case ExprType::Rethrow:
-      case ExprType::ReturnCall:
-      case ExprType::ReturnCallIndirect:
       case ExprType::Throw:
       case ExprType::Try:
-      case ExprType::MemoryCopy:
-      case ExprType::DataDrop:
-      case ExprType::MemoryInit:
-      case ExprType::MemoryFill:
       case ExprType::TableCopy:
       case ExprType::ElemDrop:
       case ExprType::TableInit:
@@ -1546,7 +4667,9 @@ void CWriter::Write(const ExprList& exprs) {
         assert(module_->memories.size() == 1);
         Memory* memory = module_->memories[0];
 
-        Write(StackVar(0), " = MemoryGrow(mem, ", ExternalPtr(memory->name), "Max, ", StackVar(0), ")", Newline());
+        Write(StackVar(0), " = MemoryGrow(mem, ", ExternalPtr(memory->name), "Max, ", StackValue(0), ")", Newline());
+        DropTypes(1);
+        PushType(Type::I32);
         break;
       }
 
@@ -1559,18 +4682,86 @@ void CWriter::Write(const ExprList& exprs) {
         break;
       }
 
+      case ExprType::MemoryCopy:
+        if (!WriteUnrolledMemoryOp(false, true)) {
+          Write("MemMove(mem, ", StackValue(2), ", ", StackValue(1), ", ", StackValue(0), ")", Newline());
+        }
+        DropTypes(3);
+        break;
+
+      case ExprType::MemoryFill:
+        if (!WriteUnrolledMemoryOp(true, false)) {
+          Write("MemSet(mem, ", StackValue(2), ", ", StackValue(1), ", ", StackValue(0), ")", Newline());
+        }
+        DropTypes(3);
+        break;
+
+      case ExprType::MemoryInit: {
+        const Index segment_index = module_->GetDataSegmentIndex(cast<MemoryInitExpr>(&expr)->var);
+        // Active segments count as dropped once the module is instantiated.
+        Write("MemoryInit(mem, ");
+        if (module_->data_segments[segment_index]->kind == SegmentKind::Passive) {
+          Write("m.", options_.name_prefix, "_data__[", segment_index, "]");
+        } else {
+          Write("\"\"");
+        }
+        Write(", ", StackValue(2), ", ", StackValue(1), ", ", StackValue(0), ")", Newline());
+        DropTypes(3);
+        break;
+      }
+
+      case ExprType::DataDrop: {
+        const Index segment_index = module_->GetDataSegmentIndex(cast<DataDropExpr>(&expr)->var);
+        if (module_->data_segments[segment_index]->kind == SegmentKind::Passive) {
+          Write("m.", options_.name_prefix, "_data__[", segment_index, "] = \"\"", Newline());
+        }
+        break;
+      }
+
       case ExprType::Nop:
         break;
 
-      case ExprType::Return:
-        // Goto the function label instead; this way we can do shared function
-        // cleanup code in one place.
-        Write(GotoLabel(Var(label_stack_.size() - 1)), Newline());
-        // Stop processing this ExprList, since the following are unreachable.
+      case ExprType::Return:
+        WriteReturn();
+        // Stop processing this ExprList, since the following are unreachable.
+        return;
+
+      case ExprType::ReturnCall:
+        if (IsSelfTailCall(iter, exprs) && PassesSpecializedParams()) {
+          WriteSelfTailCall();
+        } else {
+          WriteCall(cast<ReturnCallExpr>(&expr)->var);
+          WriteReturn();
+        }
+        return;
+
+      case ExprType::ReturnCallIndirect:
+        WriteCallIndirect(cast<ReturnCallIndirectExpr>(&expr)->decl);
+        WriteReturn();
         return;
 
       case ExprType::Select: {
         Type type = StackType(1);
+        const Const* condition = GetStackConst(0);
+        if (condition) {
+          if (condition->u32() != 0) {
+            // The first value is already in place.
+            DropTypes(2);
+          } else {
+            // Constants can move down the stack as is, anything else is copied.
+            StackValueInfo second = StackInfo(1);
+            if (!second.is_const || !second.pending) {
+              Write(StackVar(2, type), " = ", StackValue(1), Newline());
+              second.pending = false;
+              second.sign_extended = false;
+            }
+            DropTypes(3);
+            PushType(type);
+            StackInfo(0) = second;
+          }
+          break;
+        }
+        FlushPendingValues();
         Write("If ", StackVar(0), " = 0 Then", OpenBrace());
         Write(StackVar(2), " = ", StackVar(1), Newline());
         Write(CloseBrace(), "End If", Newline());
@@ -1590,46 +4781,421 @@ void CWriter::Write(const ExprList& exprs) {
         break;
 
       case ExprType::Ternary:
+        FlushPendingValues();
         Write(*cast<TernaryExpr>(&expr));
         break;
 
       case ExprType::SimdLaneOp: {
+        FlushPendingValues();
         Write(*cast<SimdLaneOpExpr>(&expr));
         break;
       }
 
       case ExprType::SimdShuffleOp: {
+        FlushPendingValues();
         Write(*cast<SimdShuffleOpExpr>(&expr));
         break;
       }
 
       case ExprType::LoadSplat:
+        FlushPendingValues();
         Write(*cast<LoadSplatExpr>(&expr));
         break;
 
       case ExprType::Unreachable:
         Write("Unreachable()", Newline());
+        DiscardPendingValues();
         return;
     }
+
+    if (max_bits != kUnknownBits) {
+      StackInfo(0).max_bits = std::min(StackInfo(0).max_bits, max_bits);
+    }
+  }
+}
+
+// Recognizes a loop that fills, copies or scans bytes one at a time, like
+//   loop: mem[p + k] = v; p += 1; br_if loop (p != end)
+//   loop: mem[d] = mem[s]; d += 1; s += 1; br_if loop (d < end)
+//   loop: p += 1; br_if loop (mem[p])
+// by evaluating one iteration symbolically, and replaces it with a call to the
+// runtime routine. Every local that changes must step by exactly one.
+bool CWriter::WriteLoopIdiom(const Block& block) {
+  if (!block.decl.sig.param_types.empty() || !block.decl.sig.result_types.empty() ||
+      block.exprs.empty() || block.exprs.back().type() != ExprType::BrIf) {
+    return false;
+  }
+  const Var& target = cast<BrIfExpr>(&block.exprs.back())->var;
+  if (target.is_name() ? target.name() != block.label : target.index() != 0) {
+    return false;
+  }
+
+  std::vector<std::string> index_to_name;
+  MakeTypeBindingReverseMapping(func_->GetNumParamsAndLocals(), func_->bindings, &index_to_name);
+  auto write_affine = [&](const AffineValue& value) {
+    for (size_t i = 0; i < value.locals.size(); ++i) {
+      if (i != 0) {
+        Write(" + ");
+      }
+      Write(LocalName(index_to_name[value.locals[i]]));
+    }
+    if (value.locals.empty()) {
+      Write(Index(static_cast<uint32_t>(value.offset)));
+    } else if (value.offset > 0) {
+      Write(" + ", Index(value.offset));
+    } else if (value.offset < 0) {
+      Write(" - ", Index(-value.offset));
+    }
+  };
+
+  std::map<Index, AffineValue> current;
+  auto local_value = [&](Index local) {
+    auto iter = current.find(local);
+    if (iter != current.end()) {
+      return iter->second;
+    }
+    AffineValue value;
+    if (const Const* constant = GetSpecializedParam(local)) {
+      value.offset = static_cast<int32_t>(constant->u32());
+    } else {
+      value.locals.push_back(local);
+    }
+    return value;
+  };
+
+  std::vector<IdiomValue> stack;
+  bool has_store = false;
+  AffineValue store_address;
+  IdiomValue store_value;
+  IdiomValue condition;
+  for (const Expr& expr : block.exprs) {
+    IdiomValue result;
+    switch (expr.type()) {
+      case ExprType::LocalGet: {
+        const Var& var = cast<LocalGetExpr>(&expr)->var;
+        if (func_->GetLocalType(var) != Type::I32) {
+          return false;
+        }
+        result.value = local_value(func_->GetLocalIndex(var));
+        stack.push_back(result);
+        continue;
+      }
+
+      case ExprType::LocalSet:
+      case ExprType::LocalTee: {
+        const Var& var = expr.type() == ExprType::LocalSet ? cast<LocalSetExpr>(&expr)->var : cast<LocalTeeExpr>(&expr)->var;
+        if (stack.empty() || stack.back().kind != IdiomValue::Kind::Affine || func_->GetLocalType(var) != Type::I32) {
+          return false;
+        }
+        current[func_->GetLocalIndex(var)] = stack.back().value;
+        if (expr.type() == ExprType::LocalSet) {
+          stack.pop_back();
+        }
+        continue;
+      }
+
+      case ExprType::Const: {
+        const Const& const_ = cast<ConstExpr>(&expr)->const_;
+        if (const_.type() != Type::I32) {
+          return false;
+        }
+        result.value.offset = static_cast<int32_t>(const_.u32());
+        stack.push_back(result);
+        continue;
+      }
+
+      case ExprType::Binary: {
+        if (cast<BinaryExpr>(&expr)->opcode != Opcode::I32Add || stack.size() < 2 ||
+            stack[stack.size() - 1].kind != IdiomValue::Kind::Affine ||
+            stack[stack.size() - 2].kind != IdiomValue::Kind::Affine) {
+          return false;
+        }
+        const AffineValue rhs = stack.back().value;
+        stack.pop_back();
+        AffineValue& lhs = stack.back().value;
+        lhs.locals.insert(lhs.locals.end(), rhs.locals.begin(), rhs.locals.end());
+        lhs.offset += rhs.offset;
+        continue;
+      }
+
+      case ExprType::Compare: {
+        const Opcode opcode = cast<CompareExpr>(&expr)->opcode;
+        if ((opcode != Opcode::I32Ne && opcode != Opcode::I32LtU && opcode != Opcode::I32GtU) || stack.size() < 2 ||
+            stack[stack.size() - 1].kind != IdiomValue::Kind::Affine ||
+            stack[stack.size() - 2].kind != IdiomValue::Kind::Affine) {
+          return false;
+        }
+        result.kind = IdiomValue::Kind::Compare;
+        result.opcode = opcode;
+        result.rhs = stack.back().value;
+        stack.pop_back();
+        result.value = stack.back().value;
+        stack.back() = result;
+        continue;
+      }
+
+      case ExprType::Load: {
+        const LoadExpr* load = cast<LoadExpr>(&expr);
+        if ((load->opcode != Opcode::I32Load8U && load->opcode != Opcode::I32Load8S) ||
+            stack.empty() || stack.back().kind != IdiomValue::Kind::Affine) {
+          return false;
+        }
+        stack.back().kind = IdiomValue::Kind::Load;
+        stack.back().value.offset += load->offset;
+        continue;
+      }
+
+      case ExprType::Store: {
+        const StoreExpr* store = cast<StoreExpr>(&expr);
+        if (store->opcode != Opcode::I32Store8 || has_store || stack.size() < 2 ||
+            stack[stack.size() - 1].kind == IdiomValue::Kind::Compare ||
+            stack[stack.size() - 2].kind != IdiomValue::Kind::Affine) {
+          return false;
+        }
+        has_store = true;
+        store_value = stack.back();
+        stack.pop_back();
+        store_address = stack.back().value;
+        store_address.offset += store->offset;
+        stack.pop_back();
+        continue;
+      }
+
+      case ExprType::BrIf:
+        if (&expr != &block.exprs.back() || stack.size() != 1) {
+          return false;
+        }
+        condition = stack.back();
+        stack.pop_back();
+        continue;
+
+      default:
+        return false;
+    }
+  }
+
+  // Every local that changes must be incremented by one.
+  std::set<Index> stepped;
+  for (const auto& pair : current) {
+    const AffineValue& value = pair.second;
+    if (value.locals.size() == 1 && value.locals[0] == pair.first && value.offset == 0) {
+      continue;
+    }
+    if (value.locals.size() != 1 || value.locals[0] != pair.first || value.offset != 1) {
+      return false;
+    }
+    stepped.insert(pair.first);
+  }
+  auto count_stepped = [&](const AffineValue& value) {
+    return std::count_if(value.locals.begin(), value.locals.end(), [&](Index local) { return stepped.count(local) != 0; });
+  };
+  if (stepped.empty() || !stack.empty()) {
+    return false;
+  }
+  // Pending values may read the locals we're about to step.
+  FlushPendingValues();
+
+  if (!has_store) {
+    // A scan: the loop continues while the byte after the step is non-zero.
+    if (condition.kind != IdiomValue::Kind::Load || stepped.size() != 1 ||
+        condition.value.locals.size() != 1 || count_stepped(condition.value) != 1) {
+      return false;
+    }
+    const LocalName local(index_to_name[*stepped.begin()]);
+    Write(local, " = ", local, " + StrLen(mem, ");
+    write_affine(condition.value);
+    Write(") + 1", Newline());
+    local_info_.erase(*stepped.begin());
+    return true;
+  }
+
+  // A fill or copy runs until the stepped local in the condition reaches an
+  // invariant bound.
+  if (condition.kind != IdiomValue::Kind::Compare || count_stepped(store_address) != 1) {
+    return false;
+  }
+  AffineValue counter = condition.value;
+  AffineValue bound = condition.rhs;
+  if (condition.opcode == Opcode::I32GtU || (condition.opcode == Opcode::I32Ne && count_stepped(counter) == 0)) {
+    std::swap(counter, bound);
+  }
+  if (counter.locals.size() != 1 || count_stepped(counter) != 1 ||
+      bound.locals.size() > 1 || count_stepped(bound) != 0) {
+    return false;
+  }
+  const bool fill = store_value.kind == IdiomValue::Kind::Affine;
+  if (fill ? count_stepped(store_value.value) != 0 : count_stepped(store_value.value) != 1) {
+    return false;
+  }
+
+  // The body runs once before the first check, so there is at least one.
+  if (!local_sym_map_.count("$count$")) {
+    DefineLocalScopeName("$count$");
+  }
+  const Var count("$count$");
+  Write(count, " = ");
+  write_affine(bound);
+  Write(" - (");
+  write_affine(counter);
+  Write(") + 1", Newline());
+  Write("If ", count, " < 1 Then ", count, " = 1", Newline());
+  // Overlapping bytes must be copied one at a time, exactly as the loop does.
+  Write(fill ? "MemSet(mem, " : "MemCpyForward(mem, ");
+  write_affine(store_address);
+  Write(", ");
+  write_affine(store_value.value);
+  Write(", ", count, ")", Newline());
+  for (Index local : stepped) {
+    const LocalName name(index_to_name[local]);
+    Write(name, " = ", name, " + ", count, Newline());
+    local_info_.erase(local);
+  }
+  return true;
+}
+
+// Writes the address at a stack index plus offset, folded when it is constant.
+void CWriter::WriteMemoryAddress(Index index, uint32_t offset) {
+  const Const* address = GetStackConst(index);
+  if (address) {
+    Write(Index(address->u32() + offset));
+    return;
+  }
+  Write(StackValue(index));
+  if (offset != 0) {
+    Write(" + ", offset);
+  }
+}
+
+// Writes a copy (or fill) of a small constant size as a statement per byte,
+// which beats the loop in MemMove/MemSet and the call into it. The operands
+// are the destination, source (or value) and size at the top of the stack.
+bool CWriter::WriteUnrolledMemoryOp(bool fill, bool may_overlap) {
+  const uint32_t kMaxUnrolledBytes = 16;
+  const Const* size = GetStackConst(0);
+  if (!size || size->u32() > kMaxUnrolledBytes) {
+    return false;
+  }
+
+  auto write_byte = [&](uint32_t i) {
+    Write("mem[");
+    WriteMemoryAddress(2, i);
+    Write("] = ");
+    if (fill) {
+      Write(StackValue(1));
+    } else {
+      Write("mem[");
+      WriteMemoryAddress(1, i);
+      Write("]");
+    }
+    Write(Newline());
+  };
+  auto write_forward = [&]() {
+    for (uint32_t i = 0; i < size->u32(); ++i) {
+      write_byte(i);
+    }
+  };
+  auto write_backward = [&]() {
+    for (uint32_t i = size->u32(); i-- > 0;) {
+      write_byte(i);
+    }
+  };
+
+  // Overlapping copies must read each byte before it is overwritten.
+  const Const* dst = GetStackConst(2);
+  const Const* src = GetStackConst(1);
+  if (!may_overlap || size->u32() <= 1 || (dst && src && dst->u32() <= src->u32())) {
+    write_forward();
+  } else if (dst && src) {
+    write_backward();
+  } else {
+    Write("If ", StackValue(2), " <= ", StackValue(1), " Then", OpenBrace());
+    write_forward();
+    Write(CloseBrace(), "Else", OpenBrace());
+    write_backward();
+    Write(CloseBrace(), "End If", Newline());
+  }
+  return true;
+}
+
+// Fixed point multiplies widen both sides to I64, multiply, shift the result
+// back down and wrap it:
+//   (i32.wrap_i64 (i64.shr_s (i64.mul (i64.extend_i32_s a) (i64.extend_i32_s b)) k))
+// For k <= 32 the bits that an arithmetic shift would fill in are all above
+// the ones the wrap keeps, so a logical shift of the exact LongInteger product
+// gives the same result in a single statement.
+bool CWriter::WriteWideningMulShift(ExprList::const_iterator iter, ExprList::const_iterator end) {
+  auto is_binary = [](const Expr& expr, Opcode opcode) {
+    return expr.type() == ExprType::Binary && cast<BinaryExpr>(&expr)->opcode == opcode;
+  };
+  if (!is_binary(*iter, Opcode::I64Mul)) {
+    return false;
+  }
+  for (Index i = 0; i < 2; ++i) {
+    if (!StackInfo(i).pending || !StackInfo(i).sign_extended) {
+      return false;
+    }
+  }
+
+  ExprList::const_iterator amount = std::next(iter);
+  if (amount == end || amount->type() != ExprType::Const) {
+    return false;
+  }
+  const Const& shift = cast<ConstExpr>(&*amount)->const_;
+  if (shift.type() != Type::I64 || shift.u64() == 0 || shift.u64() > 32) {
+    return false;
   }
+
+  ExprList::const_iterator shr = std::next(amount);
+  if (shr == end || !(is_binary(*shr, Opcode::I64ShrS) || is_binary(*shr, Opcode::I64ShrU))) {
+    return false;
+  }
+  ExprList::const_iterator wrap = std::next(shr);
+  if (wrap == end || wrap->type() != ExprType::Convert ||
+      cast<ConvertExpr>(&*wrap)->opcode != Opcode::I32WrapI64) {
+    return false;
+  }
+
+  Write(StackVar(1, Type::I32), " = I32WrapI64(((", StackVar(1, Type::I32), " + 0&) * ",
+        StackVar(0, Type::I32), ") >> ", Index(shift.u64()), "&)", Newline());
+  DropTypes(2);
+  PushType(Type::I32);
+  return true;
 }
 
 void CWriter::WriteSimpleUnaryExpr(Opcode opcode, const char* op) {
   Type result_type = opcode.GetResultType();
-  Write(StackVar(0, result_type), " = ", op, "(", StackVar(0), ")", Newline());
+  Write(StackVar(0, result_type), " = ", op, "(", StackValue(0), ")", Newline());
   DropTypes(1);
   PushType(opcode.GetResultType());
 }
 
+// Wraps and sign extensions leave values that already fit in max_bits as is.
+void CWriter::WriteNarrowUnaryExpr(Opcode opcode, const char* func, Index max_bits) {
+  if (StackInfo(0).max_bits > max_bits) {
+    WriteSimpleUnaryExpr(opcode, func);
+    return;
+  }
+
+  Type result_type = opcode.GetResultType();
+  if (result_type != StackType(0)) {
+    // Only I32WrapI64 changes the type, and narrowing a LongInteger that fits
+    // is just an assignment to an Integer.
+    Write("narrow% = ", StackValue(0), Newline());
+    Write(StackVar(0, result_type), " = narrow%", Newline());
+    DropTypes(1);
+    PushType(result_type);
+  }
+}
+
 void CWriter::WriteInfixBinaryExpr(Opcode opcode,
                                    const char* op,
                                    AssignOp assign_op) {
   Type result_type = opcode.GetResultType();
   Write(StackVar(1, result_type));
-  if (assign_op == AssignOp::Allowed) {
-    Write(" ", op, "= ", StackVar(0));
+  if (assign_op == AssignOp::Allowed && !IsPending(1)) {
+    Write(" ", op, "= ", StackValue(0));
   } else {
-    Write(" = ", StackVar(1), " ", op, " ", StackVar(0));
+    Write(" = ", StackValue(1), " ", op, " ", StackValue(0));
   }
   Write(Newline());
   DropTypes(2);
@@ -1638,13 +5204,169 @@ void CWriter::WriteInfixBinaryExpr(Opcode opcode,
 
 void CWriter::WritePrefixBinaryExpr(Opcode opcode, const char* op) {
   Type result_type = opcode.GetResultType();
-  Write(StackVar(1, result_type), " = ", op, "(", StackVar(1), ", ",
-        StackVar(0), ")", Newline());
+  Write(StackVar(1, result_type), " = ", op, "(", StackValue(1), ", ",
+        StackValue(0), ")", Newline());
+  DropTypes(2);
+  PushType(result_type);
+}
+
+void CWriter::WriteShiftExpr(Opcode opcode, const char* op) {
+  Type result_type = opcode.GetResultType();
+  const int mask = GetShiftMask(result_type);
+  Write(StackVar(1, result_type));
+  if (IsPending(1)) {
+    Write(" = ", StackValue(1), " ", op, " ");
+  } else {
+    Write(" ", op, "= ");
+  }
+  const Const* amount = GetStackConst(0);
+  if (amount) {
+    Write(amount->u32() & mask, result_type == Type::I64 ? "&" : "");
+  } else {
+    Write("(", StackValue(0), " AND ", mask, ")");
+  }
+  Write(Newline());
+  DropTypes(2);
+  PushType(result_type);
+}
+
+// Unsigned 64-bit division matches the native operators whenever both operands
+// have the sign bit clear, which is almost always, so we only fall back to the
+// software division when one of them doesn't. The check is left out for
+// operands that we already know are non-negative.
+void CWriter::WriteI64DivRemUExpr(Opcode opcode, bool remainder) {
+  const char* op = remainder ? "MOD" : "\\";
+  const bool lhs_non_negative = IsNonNegative(1);
+  const bool rhs_non_negative = IsNonNegative(0);
+  if (lhs_non_negative && rhs_non_negative) {
+    WriteInfixBinaryExpr(opcode, op);
+    return;
+  }
+
+  Type result_type = opcode.GetResultType();
+  Write("If ");
+  if (!lhs_non_negative) {
+    Write(StackValue(1), " >= 0&");
+  }
+  if (!lhs_non_negative && !rhs_non_negative) {
+    Write(" And ");
+  }
+  if (!rhs_non_negative) {
+    Write(StackValue(0), " >= 0&");
+  }
+  Write(" Then", OpenBrace());
+  Write(StackVar(1, result_type), " = ", StackValue(1), " ", op, " ", StackValue(0), Newline());
+  Write(CloseBrace(), "Else", OpenBrace());
+  Write(StackVar(1, result_type), " = I64DivideUnsigned(", StackValue(1), ", ", StackValue(0), ").",
+        remainder ? "remainder" : "quotient", Newline());
+  Write(CloseBrace(), "End If", Newline());
+  DropTypes(2);
+  PushType(result_type);
+}
+
+// An arithmetic shift by a constant is a logical shift with the sign bits or'd
+// back in, which avoids the branch in the general template.
+void CWriter::WriteConstShrSExpr(Opcode opcode) {
+  Type result_type = opcode.GetResultType();
+  const Index bits = result_type == Type::I64 ? 64 : 32;
+  const Index amount = GetStackConst(0)->u32() & GetShiftMask(result_type);
+  const char* suffix = result_type == Type::I64 ? "&" : "";
+  if (amount == 0) {
+    // Shifting by zero leaves the value as is.
+    DropTypes(1);
+    return;
+  }
+  Write(StackVar(1, result_type), " = (", StackValue(1), " >> ", amount, suffix,
+        ") Or ((0", suffix, " - (", StackValue(1), " >> ", bits - 1, suffix,
+        ")) << ", bits - amount, suffix, ")", Newline());
+  DropTypes(2);
+  PushType(result_type);
+}
+
+void CWriter::WriteConstRotateExpr(Opcode opcode, bool left) {
+  Type result_type = opcode.GetResultType();
+  const Index bits = result_type == Type::I64 ? 64 : 32;
+  Index amount = GetStackConst(0)->u32() & GetShiftMask(result_type);
+  const char* suffix = result_type == Type::I64 ? "&" : "";
+  if (amount == 0) {
+    DropTypes(1);
+    return;
+  }
+  if (!left) {
+    amount = bits - amount;
+  }
+  Write(StackVar(1, result_type), " = (", StackValue(1), " << ", amount, suffix,
+        ") Or (", StackValue(1), " >> ", bits - amount, suffix, ")", Newline());
+  DropTypes(2);
+  PushType(result_type);
+}
+
+// Unsigned division and remainder by a constant. Powers of two become shifts
+// and masks. Other I32 divisors divide the zero extended value natively, which
+// is a single operator instead of a call to the runtime helper.
+// Returns false if the runtime helper must be used.
+bool CWriter::WriteConstDivRemUExpr(Opcode opcode, bool remainder) {
+  Type result_type = opcode.GetResultType();
+  const Const* divisor = GetStackConst(0);
+  const uint64_t d = result_type == Type::I64 ? divisor->u64() : divisor->u32();
+  if (d == 0) {
+    // Leave the trap to the runtime.
+    return false;
+  }
+
+  if ((d & (d - 1)) == 0) {
+    const Index shift = CountTrailingZeros(d, 64);
+    if (remainder) {
+      const Const mask = result_type == Type::I64 ? Const::I64(d - 1)
+                                                  : Const::I32(static_cast<uint32_t>(d - 1));
+      Write(StackVar(1, result_type), " = ", StackValue(1), " And ", mask, Newline());
+    } else if (shift == 0) {
+      DropTypes(1);
+      return true;
+    } else {
+      Write(StackVar(1, result_type), " = ", StackValue(1), " >> ", shift,
+            result_type == Type::I64 ? "&" : "", Newline());
+    }
+    DropTypes(2);
+    PushType(result_type);
+    return true;
+  }
+
+  if (result_type != Type::I32) {
+    return false;
+  }
+
+  if (d >= 0x80000000u) {
+    // The quotient can only be 0 or 1.
+    Write("If (", StackValue(1), " And &HFFFFFFFF&) >= ", Const::I64(d), " Then", OpenBrace());
+    if (remainder) {
+      // Both operands being constant would have been folded, so the dividend
+      // is already in its variable.
+      assert(!IsPending(1));
+      Write(StackVar(1, result_type), " = ", StackValue(1), " - ", *divisor, Newline());
+    } else {
+      Write(StackVar(1, result_type), " = 1", Newline());
+      Write(CloseBrace(), "Else", OpenBrace());
+      Write(StackVar(1, result_type), " = 0", Newline());
+    }
+    Write(CloseBrace(), "End If", Newline());
+  } else if (IsNonNegative(1)) {
+    Write(StackVar(1, result_type), " = ", StackValue(1), " ", remainder ? "MOD" : "\\",
+          " ", *divisor, Newline());
+  } else {
+    // The result is less than 2^31, so it can be narrowed back to an Integer.
+    Write("narrow% = (", StackValue(1), " And &HFFFFFFFF&) ", remainder ? "MOD" : "\\",
+          " ", Const::I64(d), Newline());
+    Write(StackVar(1, result_type), " = narrow%", Newline());
+  }
   DropTypes(2);
   PushType(result_type);
+  return true;
 }
 
 void CWriter::WriteExprReplacement(Opcode opcode, size_t args, size_t offset, const std::string& input) {
+  // The replacements assign to their inputs, so they must be real variables.
+  FlushPendingValues();
   Type result_type = opcode.GetResultType();
   static const std::regex r("([^$]*)\\$(in|out|offset)([0-9]+)");
   std::string::const_iterator last_parsed_ending = input.begin();
@@ -1698,11 +5420,20 @@ void CWriter::Write(const BinaryExpr& expr) {
       break;
 
     case Opcode::I32DivU:
-      WritePrefixBinaryExpr(expr.opcode, "I32DivU");
+      if (GetStackConst(0) && WriteConstDivRemUExpr(expr.opcode, false)) {
+        break;
+      }
+      if (IsNonNegative(0) && IsNonNegative(1)) {
+        WriteInfixBinaryExpr(expr.opcode, "\\");
+      } else {
+        WritePrefixBinaryExpr(expr.opcode, "I32DivU");
+      }
       break;
 
     case Opcode::I64DivU:
-      WritePrefixBinaryExpr(expr.opcode, "I64DivU");
+      if (!GetStackConst(0) || !WriteConstDivRemUExpr(expr.opcode, false)) {
+        WriteI64DivRemUExpr(expr.opcode, false);
+      }
       break;
 
     case Opcode::F32Div:
@@ -1722,11 +5453,20 @@ void CWriter::Write(const BinaryExpr& expr) {
       break;
 
     case Opcode::I32RemU:
-      WritePrefixBinaryExpr(expr.opcode, "I32RemU");
+      if (GetStackConst(0) && WriteConstDivRemUExpr(expr.opcode, true)) {
+        break;
+      }
+      if (IsNonNegative(0) && IsNonNegative(1)) {
+        WriteInfixBinaryExpr(expr.opcode, "MOD");
+      } else {
+        WritePrefixBinaryExpr(expr.opcode, "I32RemU");
+      }
       break;
 
     case Opcode::I64RemU:
-      WritePrefixBinaryExpr(expr.opcode, "I64RemU");
+      if (!GetStackConst(0) || !WriteConstDivRemUExpr(expr.opcode, true)) {
+        WriteI64DivRemUExpr(expr.opcode, true);
+      }
       break;
 
     case Opcode::I32And:
@@ -1746,12 +5486,19 @@ void CWriter::Write(const BinaryExpr& expr) {
 
     case Opcode::I32Shl:
     case Opcode::I64Shl:
-      Write(StackVar(1), " <<= (", StackVar(0), " AND ",
-            GetShiftMask(expr.opcode.GetResultType()), ")", Newline());
-      DropTypes(1);
+      WriteShiftExpr(expr.opcode, "<<");
       break;
 
     case Opcode::I32ShrS:
+      if (IsNonNegative(1)) {
+        // Without the sign bit this is a logical shift.
+        WriteShiftExpr(expr.opcode, ">>");
+        break;
+      }
+      if (GetStackConst(0)) {
+        WriteConstShrSExpr(expr.opcode);
+        break;
+      }
       WriteExprReplacement(expr.opcode, 2, 0,
         "$in0 = $in0 And &H1F\n"
         "If $in1 < 0 And $in0 <> 0 Then\n"
@@ -1762,6 +5509,14 @@ void CWriter::Write(const BinaryExpr& expr) {
       break;
 
     case Opcode::I64ShrS:
+      if (IsNonNegative(1)) {
+        WriteShiftExpr(expr.opcode, ">>");
+        break;
+      }
+      if (GetStackConst(0)) {
+        WriteConstShrSExpr(expr.opcode);
+        break;
+      }
       WriteExprReplacement(expr.opcode, 2, 0,
         "$in0 = $in0 And &H3F\n"
         "If $in1 < 0 And $in0 <> 0 Then\n"
@@ -1773,25 +5528,39 @@ void CWriter::Write(const BinaryExpr& expr) {
 
     case Opcode::I32ShrU:
     case Opcode::I64ShrU:
-      Write(StackVar(1), " >>= (", StackVar(0), " AND ",
-            GetShiftMask(expr.opcode.GetResultType()), ")", Newline());
-      DropTypes(1);
+      WriteShiftExpr(expr.opcode, ">>");
       break;
 
     case Opcode::I32Rotl:
-      WritePrefixBinaryExpr(expr.opcode, "I32Rotl");
+      if (GetStackConst(0)) {
+        WriteConstRotateExpr(expr.opcode, true);
+      } else {
+        WritePrefixBinaryExpr(expr.opcode, "I32Rotl");
+      }
       break;
 
     case Opcode::I64Rotl:
-      WritePrefixBinaryExpr(expr.opcode, "I64Rotl");
+      if (GetStackConst(0)) {
+        WriteConstRotateExpr(expr.opcode, true);
+      } else {
+        WritePrefixBinaryExpr(expr.opcode, "I64Rotl");
+      }
       break;
 
     case Opcode::I32Rotr:
-      WritePrefixBinaryExpr(expr.opcode, "I32Rotr");
+      if (GetStackConst(0)) {
+        WriteConstRotateExpr(expr.opcode, false);
+      } else {
+        WritePrefixBinaryExpr(expr.opcode, "I32Rotr");
+      }
       break;
 
     case Opcode::I64Rotr:
-      WritePrefixBinaryExpr(expr.opcode, "I64Rotr");
+      if (GetStackConst(0)) {
+        WriteConstRotateExpr(expr.opcode, false);
+      } else {
+        WritePrefixBinaryExpr(expr.opcode, "I64Rotr");
+      }
       break;
 
     case Opcode::F32Min:
@@ -1825,7 +5594,7 @@ void CWriter::Write(const BinaryExpr& expr) {
 
 void CWriter::WriteCompareExpr(Opcode opcode, const char* op) {
   Type result_type = opcode.GetResultType();
-  Write("If ", StackVar(1), " ", op, " ", StackVar(0), " Then", OpenBrace());
+  Write("If ", StackValue(1), " ", op, " ", StackValue(0), " Then", OpenBrace());
   Write(StackVar(1, result_type), " = 1", Newline());
   Write(CloseBrace(), "Else", OpenBrace());
   Write(StackVar(1, result_type), " = 0", Newline());
@@ -1835,9 +5604,27 @@ void CWriter::WriteCompareExpr(Opcode opcode, const char* op) {
 }
 
 // We compare I32's as unsigned by promoting them to I64s first via "And &HFFFFFFFF&"
+// When either side is known to be non-negative we can stay in Integers, since
+// any negative value on the other side is simply larger.
 void CWriter::WriteCompareI32UExpr(Opcode opcode, const char* op) {
+  const bool lhs_non_negative = IsNonNegative(1);
+  const bool rhs_non_negative = IsNonNegative(0);
+  if (lhs_non_negative && rhs_non_negative) {
+    WriteCompareExpr(opcode, op);
+    return;
+  }
+
   Type result_type = opcode.GetResultType();
-  Write("If (", StackVar(1), " And &HFFFFFFFF&) ", op, " (", StackVar(0), " And &HFFFFFFFF&) Then", OpenBrace());
+  if (lhs_non_negative || rhs_non_negative) {
+    const Index negative = lhs_non_negative ? 0 : 1;
+    // Whether a negative value makes the comparison true.
+    const bool less = op[0] == '<';
+    const bool negative_passes = (negative == 1) != less;
+    Write("If ", StackValue(negative), negative_passes ? " < 0 Or " : " >= 0 And ",
+          StackValue(1), " ", op, " ", StackValue(0), " Then", OpenBrace());
+  } else {
+    Write("If (", StackValue(1), " And &HFFFFFFFF&) ", op, " (", StackValue(0), " And &HFFFFFFFF&) Then", OpenBrace());
+  }
   Write(StackVar(1, result_type), " = 1", Newline());
   Write(CloseBrace(), "Else", OpenBrace());
   Write(StackVar(1, result_type), " = 0", Newline());
@@ -1846,6 +5633,14 @@ void CWriter::WriteCompareI32UExpr(Opcode opcode, const char* op) {
   PushType(result_type);
 }
 
+void CWriter::WriteCompareI64UExpr(Opcode opcode, const char* op, const char* func) {
+  if (IsNonNegative(0) && IsNonNegative(1)) {
+    WriteCompareExpr(opcode, op);
+  } else {
+    WritePrefixBinaryExpr(opcode, func);
+  }
+}
+
 void CWriter::Write(const CompareExpr& expr) {
   switch (expr.opcode) {
     case Opcode::I32Eq:
@@ -1900,16 +5695,16 @@ void CWriter::Write(const CompareExpr& expr) {
     
 
     case Opcode::I64LtU:
-      WritePrefixBinaryExpr(expr.opcode, "I64LtU");
+      WriteCompareI64UExpr(expr.opcode, "<", "I64LtU");
       break;
     case Opcode::I64LeU:
-      WritePrefixBinaryExpr(expr.opcode, "I64LeU");
+      WriteCompareI64UExpr(expr.opcode, "<=", "I64LeU");
       break;
     case Opcode::I64GtU:
-      WritePrefixBinaryExpr(expr.opcode, "I64GtU");
+      WriteCompareI64UExpr(expr.opcode, ">", "I64GtU");
       break;
     case Opcode::I64GeU:
-      WritePrefixBinaryExpr(expr.opcode, "I64GeU");
+      WriteCompareI64UExpr(expr.opcode, ">=", "I64GeU");
       break;
 
     default:
@@ -1919,7 +5714,7 @@ void CWriter::Write(const CompareExpr& expr) {
 
 void CWriter::WriteEqzExpr(Opcode opcode) {
   Type result_type = opcode.GetResultType();
-  Write("If ", StackVar(0), " = ", result_type == Type::I32 ? Const::I32(0) : Const::I64(0), " Then", OpenBrace());
+  Write("If ", StackValue(0), " = ", result_type == Type::I32 ? Const::I32(0) : Const::I64(0), " Then", OpenBrace());
   Write(StackVar(0, result_type), " = 1", Newline());
   Write(CloseBrace(), "Else", OpenBrace());
   Write(StackVar(0, result_type), " = 0", Newline());
@@ -1936,15 +5731,30 @@ void CWriter::Write(const ConvertExpr& expr) {
       break;
 
     case Opcode::I64ExtendI32S:
-      WriteSimpleUnaryExpr(expr.opcode, "I64ExtendI32S");
+      // I32 values are Integers, which promote to LongIntegers with their sign.
+      // The extension is left pending so that it can be inlined into whatever
+      // uses it, while the I32 stack variable still holds the value.
+      DropTypes(1);
+      PushType(Type::I64);
+      StackInfo(0).pending = true;
+      StackInfo(0).sign_extended = true;
       break;
 
     case Opcode::I64ExtendI32U:
-      WriteSimpleUnaryExpr(expr.opcode, "I64ExtendI32U");
+      Write(StackVar(0, Type::I64), " = ", StackValue(0));
+      Write(IsNonNegative(0) ? " + 0&" : " And &HFFFFFFFF&", Newline());
+      DropTypes(1);
+      PushType(Type::I64);
       break;
 
     case Opcode::I32WrapI64:
-      WriteSimpleUnaryExpr(expr.opcode, "I32WrapI64");
+      if (StackInfo(0).pending && StackInfo(0).sign_extended) {
+        // The I32 stack variable still holds the original value.
+        DropTypes(1);
+        PushType(Type::I32);
+        break;
+      }
+      WriteNarrowUnaryExpr(expr.opcode, "I32WrapI64", 31);
       break;
 
     case Opcode::I32TruncF32S:
@@ -2078,6 +5888,14 @@ void CWriter::Write(const LoadExpr& expr) {
 
   Type result_type = expr.opcode.GetResultType();
 
+  auto slot = frame_slot_exprs_.find(&expr);
+  if (slot != frame_slot_exprs_.end()) {
+    DropTypes(1);
+    PushType(result_type);
+    Write(StackVar(0, result_type), " = ", frame_slots_[slot->second], Newline());
+    return;
+  }
+
   size_t int_size = 0;
   switch (expr.opcode) {
     case Opcode::I32Load: int_size = 4; break;
@@ -2089,14 +5907,28 @@ void CWriter::Write(const LoadExpr& expr) {
   // We'd like to handle all the integer operations such as I64, but we need to handle casting back to I64
   if (int_size != 0) {
     wabt::Address expr_offset_or_zero = expr.offset;
+    bool check_alignment = false;
 
     // Extra special case for I32Load where we can use GetSignedLong if it's 4 byte aligned
     if (expr.opcode == Opcode::I32Load) {
-      if (expr_offset_or_zero != 0) {
-        Write(StackVar(0), " += ", expr_offset_or_zero, Newline());
-        expr_offset_or_zero = 0;
+      const Const* address = GetStackConst(0);
+      if (address) {
+        // The alignment of a constant address is known now.
+        const uint64_t effective_address = uint64_t(address->u32()) + expr.offset;
+        if ((effective_address & 3) == 0) {
+          Write(StackVar(0, result_type), " = mem.GetSignedLong(", Index(effective_address >> 2), ")", Newline());
+          DropTypes(1);
+          PushType(result_type);
+          return;
+        }
+      } else {
+        if (expr_offset_or_zero != 0) {
+          Write(StackVar(0), " += ", expr_offset_or_zero, Newline());
+          expr_offset_or_zero = 0;
+        }
+        Write("If ", StackVar(0), " And &H3 Then", OpenBrace());
+        check_alignment = true;
       }
-      Write("If ", StackVar(0), " And &H3 Then", OpenBrace());
     }
 
     Write(StackVar(0, result_type), " = ");
@@ -2104,7 +5936,7 @@ void CWriter::Write(const LoadExpr& expr) {
       if (i != 0) {
         Write(" + ");
       }
-      Write("(mem[", StackVar(0));
+      Write("(mem[", StackValue(0));
       wabt::Address offset = expr_offset_or_zero + i;
       if (offset != 0) {
         Write(" + ", offset);
@@ -2117,7 +5949,7 @@ void CWriter::Write(const LoadExpr& expr) {
     }
     Write(Newline());
 
-    if (expr.opcode == Opcode::I32Load) {
+    if (check_alignment) {
       Write(CloseBrace(), "Else", OpenBrace());
       Write(StackVar(0, result_type), " = mem.GetSignedLong(", StackVar(0), " >> 2)", Newline());
       Write(CloseBrace(), "End If", Newline());
@@ -2130,7 +5962,7 @@ void CWriter::Write(const LoadExpr& expr) {
   // Optimize for where we can use GetSignedByte.
   // TODO(trevor): Also optimize I64Load8S but convert to LongInteger.
   if (expr.opcode == Opcode::I32Load8S) {
-    Write(StackVar(0, result_type), " = mem.GetSignedByte(", StackVar(0));
+    Write(StackVar(0, result_type), " = mem.GetSignedByte(", StackValue(0));
     if (expr.offset != 0) {
       Write(" + ", expr.offset);
     }
@@ -2162,7 +5994,7 @@ void CWriter::Write(const LoadExpr& expr) {
       BRS_UNREACHABLE;
   }
 
-  Write(StackVar(0, result_type), " = ", func, "(mem, ", StackVar(0));
+  Write(StackVar(0, result_type), " = ", func, "(mem, ", StackValue(0));
   if (expr.offset != 0)
     Write(" + ", expr.offset);
   Write(")", Newline());
@@ -2174,6 +6006,13 @@ void CWriter::Write(const StoreExpr& expr) {
   assert(module_->memories.size() == 1);
   Memory* memory = module_->memories[0];
 
+  auto slot = frame_slot_exprs_.find(&expr);
+  if (slot != frame_slot_exprs_.end()) {
+    Write(frame_slots_[slot->second], " = ", StackValue(0), Newline());
+    DropTypes(2);
+    return;
+  }
+
   size_t int_size = 0;
   switch (expr.opcode) {
     case Opcode::I32Store: int_size = 4; break;
@@ -2187,14 +6026,23 @@ void CWriter::Write(const StoreExpr& expr) {
 
   // Special case for storing integer bytes (faster than calling)
   if (int_size != 0) {
+    // The bytes of a constant are computed here rather than on the device.
+    const Const* value = GetStackConst(0);
+    const uint64_t bits = !value ? 0 : value->type() == Type::I32 ? value->u32() : value->u64();
+    if (!value && IsPending(0)) {
+      // Each byte reads the variable, so assign it once.
+      FlushPendingValues();
+    }
     for (size_t i = 0; i < int_size; ++i) {
-      Write("mem[", StackVar(1));
+      Write("mem[", StackValue(1));
       wabt::Address offset = expr.offset + i;
       if (offset != 0) {
         Write(" + ", offset);
       }
       Write("] = ");
-      if (i == 0) {
+      if (value) {
+        Write(Index((bits >> (i * 8)) & 0xFF));
+      } else if (i == 0) {
         Write(StackVar(0));
       } else {
         Write("(", StackVar(0), " >> ", i * 8, i >= 4 ? "&)" : ")");
@@ -2213,10 +6061,10 @@ void CWriter::Write(const StoreExpr& expr) {
       BRS_UNREACHABLE;
   }
 
-  Write(func, "(mem, ", StackVar(1));
+  Write(func, "(mem, ", StackValue(1));
   if (expr.offset != 0)
     Write(" + ", expr.offset);
-  Write(", ", StackVar(0), ")", Newline());
+  Write(", ", StackValue(0), ")", Newline());
   DropTypes(2);
 }
 
@@ -2300,23 +6148,23 @@ void CWriter::Write(const UnaryExpr& expr) {
       break;
 
     case Opcode::I32Extend8S:
-      WriteSimpleUnaryExpr(expr.opcode, "I32Extend8S");
+      WriteNarrowUnaryExpr(expr.opcode, "I32Extend8S", 7);
       break;
 
     case Opcode::I32Extend16S:
-      WriteSimpleUnaryExpr(expr.opcode, "I32Extend16S");
+      WriteNarrowUnaryExpr(expr.opcode, "I32Extend16S", 15);
       break;
 
     case Opcode::I64Extend8S:
-      WriteSimpleUnaryExpr(expr.opcode, "I64Extend8S");
+      WriteNarrowUnaryExpr(expr.opcode, "I64Extend8S", 7);
       break;
 
     case Opcode::I64Extend16S:
-      WriteSimpleUnaryExpr(expr.opcode, "I64Extend16S");
+      WriteNarrowUnaryExpr(expr.opcode, "I64Extend16S", 15);
       break;
 
     case Opcode::I64Extend32S:
-      WriteSimpleUnaryExpr(expr.opcode, "I64Extend32S");
+      WriteNarrowUnaryExpr(expr.opcode, "I64Extend32S", 31);
       break;
 
     default:
@@ -2425,6 +6273,15 @@ std::string CWriter::GetFilename(size_t index) {
   }
 }
 
+std::string CWriter::GetSidecarFilename(const char* extension) {
+  const size_t slash = options_.out_filename.find_last_of("/");
+  const size_t dot = options_.out_filename.find_last_of(".");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    return options_.out_filename + extension;
+  }
+  return options_.out_filename.substr(0, dot) + extension;
+}
+
 FileStream CWriter::OpenFileStream(size_t index) {
   return FileStream(GetFilename(index).c_str());
 }
@@ -2441,16 +6298,33 @@ void CWriter::WriteModule(const Module& module) {
     }
   }
 
+  // Export wrappers keep their legalized names, so minified names must not
+  // take them first.
+  if (options_.minify) {
+    for (const Export* export_ : module.exports) {
+      if (export_->kind == ExternalKind::Func) {
+        global_syms_.insert(LegalizeName("", options_.name_prefix, export_->name));
+      }
+    }
+  }
+
   DefineFuncDeclarations();
   DefineMemories();
   DefineTables();
   WriteImports();
   WriteGlobals();
+  // The functions are written first so the table can refer to folded ones.
+  ComputeReachableFuncs();
+  ComputeResultArrays();
+  ComputeGlobalEffects();
+  ComputeTableEntries();
+  ComputeSpecializations();
+  WriteFuncs();
   WriteDataInitializers();
   WriteElemInitializers();
   WriteInitExports();
-  WriteFuncs();
   WriteInit();
+  WriteSnapshotFunctions();
 
   const size_t brightscript_size_limit = 1024 * 1024 * 2;
   const size_t brightscript_line_limit = 65535;
@@ -2485,6 +6359,17 @@ void CWriter::WriteModule(const Module& module) {
     lines += chunk_lines;
     bytes += chunk_bytes;
   }
+
+  if (options_.lazy) {
+    WriteLazyGroups();
+  }
+
+  if (options_.minify && !options_.out_filename.empty()) {
+    FileStream map_file(GetSidecarFilename(".map").c_str());
+    for (const auto& pair : minified_names_) {
+      map_file.Writef("%s %s\n", pair.first.c_str(), pair.second.c_str());
+    }
+  }
 }
 
 }  // end anonymous namespace
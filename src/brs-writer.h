@@ -27,11 +27,38 @@
 namespace wabt {
 
 struct Module;
+struct Snapshot;
 class Stream;
 
+enum class NativeMath {
+  None,   // Always run the translated libm code.
+  Float,  // Use the single precision natives for float functions.
+  All,    // Also use them for double functions, losing precision.
+};
+
 struct WriteCOptions {
   std::string name_prefix;
   std::string out_filename;
+  // Write the initial memory image to a .bin file next to the output and load
+  // it at startup from data_file_dir, rather than embedding it in the code.
+  bool data_file = false;
+  std::string data_file_dir = "pkg:/source/";
+  // Initial memory, globals and table captured at build time. When set, the
+  // segments, global initializers and start function are not emitted.
+  const Snapshot* snapshot = nullptr;
+  // Functions that aren't reachable from the exports, start function or table
+  // are dropped, unless their name (without the leading $) is listed here.
+  std::vector<std::string> keep;
+  // Use short names for functions and locals, and drop comments and
+  // indentation. The original function names are written to a .map file.
+  bool minify = false;
+  // Write the functions that the start function and lazy_hot can't reach to
+  // separate scripts that are loaded from lazy_dir with Run() on first use.
+  bool lazy = false;
+  std::vector<std::string> lazy_hot;
+  std::string lazy_dir = "pkg:/lazy/";
+  // Which libm functions are replaced with native BrightScript math.
+  NativeMath native_math = NativeMath::None;
 };
 
 Result WriteBrs(const Module*, const WriteCOptions&);
@@ -0,0 +1,126 @@
+/*
+  Copyright 2020 Trevor Sundberg
+  All modifications are licenced under LICENSE.md
+*/
+
+#include "snapshot.h"
+
+#include <algorithm>
+
+#include "src/binary-reader.h"
+#include "src/binary-writer.h"
+#include "src/cast.h"
+#include "src/interp/binary-reader-interp.h"
+#include "src/interp/interp.h"
+#include "src/stream.h"
+
+namespace wabt {
+
+static Result SnapshotError(Errors* errors, const std::string& message) {
+  errors->emplace_back(ErrorLevel::Error, Location(), "snapshot: " + message);
+  return Result::Error;
+}
+
+Result TakeSnapshot(const Module& module, const Features& features, const std::string& init_export, Snapshot* out, Errors* errors) {
+  // Only functions can be provided from outside, and only as long as they are
+  // never called, since the host isn't available at build time.
+  if (module.num_memory_imports != 0 || module.num_table_imports != 0 || module.num_global_imports != 0) {
+    return SnapshotError(errors, "modules that import a memory, table or global are not supported");
+  }
+
+  // The interpreter reads binary modules, so round trip the IR through one.
+  MemoryStream stream;
+  WriteBinaryOptions write_options;
+  write_options.features = features;
+  CHECK_RESULT(WriteBinaryModule(&stream, &module, write_options));
+  const OutputBuffer& buffer = stream.output_buffer();
+
+  const bool kReadDebugNames = false;
+  const bool kStopOnFirstError = true;
+  const bool kFailOnCustomSectionError = true;
+  ReadBinaryOptions read_options(features, nullptr, kReadDebugNames, kStopOnFirstError, kFailOnCustomSectionError);
+  interp::ModuleDesc module_desc;
+  CHECK_RESULT(interp::ReadBinaryInterp(buffer.data.data(), buffer.size(), read_options, errors, &module_desc));
+
+  interp::Store store(features);
+  interp::Module::Ptr interp_module = interp::Module::New(store, module_desc);
+
+  interp::RefVec imports;
+  for (const interp::ImportDesc& import : interp_module->desc().imports) {
+    const std::string name = import.type.module + "." + import.type.name;
+    auto* func_type = cast<interp::FuncType>(import.type.type.get());
+    interp::HostFunc::Ptr func = interp::HostFunc::New(store, *func_type,
+        [&store, name](interp::Thread& thread, const interp::Values& params, interp::Values& results, interp::Trap::Ptr* out_trap) -> Result {
+          *out_trap = interp::Trap::New(store, "initialization called import " + name);
+          return Result::Error;
+        });
+    imports.push_back(func.ref());
+  }
+
+  // Instantiating copies the segments and runs the start function.
+  interp::Trap::Ptr trap;
+  interp::Instance::Ptr instance = interp::Instance::Instantiate(store, interp_module.ref(), imports, &trap);
+  if (!instance) {
+    return SnapshotError(errors, trap ? trap->message() : "instantiation failed");
+  }
+
+  if (!init_export.empty()) {
+    const std::vector<interp::ExportDesc>& exports = interp_module->desc().exports;
+    auto iter = std::find_if(exports.begin(), exports.end(), [&](const interp::ExportDesc& export_) {
+      return export_.type.name == init_export && export_.type.type->kind == ExternalKind::Func;
+    });
+    if (iter == exports.end()) {
+      return SnapshotError(errors, "no exported function named " + init_export);
+    }
+
+    interp::Func::Ptr func = store.UnsafeGet<interp::Func>(instance->exports()[iter - exports.begin()]);
+    if (!func->type().params.empty() || !func->type().results.empty()) {
+      return SnapshotError(errors, init_export + " must take no parameters and return nothing");
+    }
+
+    interp::Values params;
+    interp::Values results;
+    if (Failed(func->Call(store, params, results, &trap))) {
+      return SnapshotError(errors, trap->message());
+    }
+  }
+
+  if (!instance->memories().empty()) {
+    interp::Memory::Ptr memory = store.UnsafeGet<interp::Memory>(instance->memories()[0]);
+    out->memory.assign(memory->UnsafeData(), memory->UnsafeData() + memory->ByteSize());
+  }
+
+  for (interp::Ref ref : instance->globals()) {
+    interp::Global::Ptr global = store.UnsafeGet<interp::Global>(ref);
+    const interp::Value value = global->Get();
+    switch (global->type().type) {
+      case Type::I32:
+        out->globals.push_back(Const::I32(value.Get<u32>()));
+        break;
+      case Type::I64:
+        out->globals.push_back(Const::I64(value.Get<u64>()));
+        break;
+      case Type::F32:
+        out->globals.push_back(Const::F32(Bitcast<u32>(value.Get<f32>())));
+        break;
+      case Type::F64:
+        out->globals.push_back(Const::F64(Bitcast<u64>(value.Get<f64>())));
+        break;
+      default:
+        return SnapshotError(errors, "unsupported global type");
+    }
+  }
+
+  if (!instance->tables().empty()) {
+    interp::Table::Ptr table = store.UnsafeGet<interp::Table>(instance->tables()[0]);
+    const interp::RefVec& funcs = instance->funcs();
+    for (interp::Ref element : table->elements()) {
+      auto iter = std::find(funcs.begin(), funcs.end(), element);
+      out->table.push_back(iter == funcs.end() ? kInvalidIndex : static_cast<Index>(iter - funcs.begin()));
+    }
+  }
+
+  return Result::Ok;
+}
+
+}  // namespace wabt
@@ -0,0 +1,37 @@
+/*
+  Copyright 2020 Trevor Sundberg
+  All modifications are licenced under LICENSE.md
+*/
+
+#ifndef WASM2BRS_SNAPSHOT_H_
+#define WASM2BRS_SNAPSHOT_H_
+
+#include <string>
+#include <vector>
+
+#include "src/common.h"
+#include "src/error.h"
+#include "src/feature.h"
+#include "src/ir.h"
+
+namespace wabt {
+
+// The state of a module after it has been instantiated (and optionally after
+// an exported initialization function has run), captured at build time.
+struct Snapshot {
+  // Contents of the module's memory, sized to its current page count.
+  std::vector<uint8_t> memory;
+  // Values of the module's globals, indexed like Module::globals.
+  std::vector<Const> globals;
+  // Function index of each table element, or kInvalidIndex when unset.
+  std::vector<Index> table;
+};
+
+// Runs the module's start function, and then init_export if it isn't empty,
+// in wabt's interpreter. Fails if the module imports a memory, table or
+// global, or if initialization calls an imported function or traps.
+Result TakeSnapshot(const Module&, const Features&, const std::string& init_export, Snapshot*, Errors*);
+
+}  // namespace wabt
+
+#endif /* WASM2BRS_SNAPSHOT_H_ */
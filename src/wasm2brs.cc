@@ -23,6 +23,7 @@
 #include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include "src/apply-names.h"
 #include "src/wast-parser.h"
@@ -38,6 +39,7 @@
 #include "src/wast-lexer.h"
 
 #include "brs-writer.h"
+#include "snapshot.h"
 
 using namespace wabt;
 
@@ -47,6 +49,8 @@ static std::string s_prefix;
 static Features s_features;
 static WriteCOptions s_write_c_options;
 static bool s_read_debug_names = true;
+static bool s_snapshot = false;
+static std::string s_snapshot_init;
 static std::unique_ptr<FileStream> s_log_stream;
 
 static const char s_description[] =
@@ -61,6 +65,20 @@ examples:
   $ wasm2c test.wasm --no-debug-names -o test.c
 )";
 
+static void SplitNames(const std::string& names, std::vector<std::string>* out) {
+  size_t begin = 0;
+  while (begin <= names.size()) {
+    size_t end = names.find(',', begin);
+    if (end == std::string::npos) {
+      end = names.size();
+    }
+    if (end != begin) {
+      out->push_back(names.substr(begin, end - begin));
+    }
+    begin = end + 1;
+  }
+}
+
 static void ParseOptions(int argc, char** argv) {
   OptionParser parser("wasm2c", s_description);
 
@@ -87,18 +105,81 @@ static void ParseOptions(int argc, char** argv) {
                      [](const char* argument) {
                        s_write_c_options.name_prefix = argument;
                      });
+  parser.AddOption("data-file", "Write the initial memory to a .bin file next to the output file (requires -o)",
+                   []() { s_write_c_options.data_file = true; });
+  parser.AddOption("data-file-dir", "DIR", "The directory the .bin file is read from on the device, by default pkg:/source/",
+                   [](const char* argument) {
+                     s_write_c_options.data_file_dir = argument;
+                     if (!s_write_c_options.data_file_dir.empty() && s_write_c_options.data_file_dir.back() != '/') {
+                       s_write_c_options.data_file_dir += '/';
+                     }
+                   });
+  parser.AddOption("keep", "NAMES", "Comma separated functions to keep even if they are unreachable from the exports, start function and table",
+                   [](const char* argument) {
+                     SplitNames(argument, &s_write_c_options.keep);
+                   });
+  parser.AddOption("minify", "Use short names for functions and locals, drop comments and indentation, and write the original names to a .map file",
+                   []() { s_write_c_options.minify = true; });
+  parser.AddOption("lazy", "Write functions the start function can't reach to scripts that are loaded with Run() on first use (requires -o)",
+                   []() { s_write_c_options.lazy = true; });
+  parser.AddOption("lazy-hot", "NAMES", "Comma separated functions that, with everything they call, are compiled at launch (implies --lazy)",
+                   [](const char* argument) {
+                     s_write_c_options.lazy = true;
+                     SplitNames(argument, &s_write_c_options.lazy_hot);
+                   });
+  parser.AddOption("lazy-dir", "DIR", "The directory the lazy scripts are read from on the device, by default pkg:/lazy/",
+                   [](const char* argument) {
+                     s_write_c_options.lazy_dir = argument;
+                     if (!s_write_c_options.lazy_dir.empty() && s_write_c_options.lazy_dir.back() != '/') {
+                       s_write_c_options.lazy_dir += '/';
+                     }
+                   });
+  parser.AddOption("native-math", "PRECISION", "Replace libm functions with native math: 'float' for float functions (sinf, ...), 'all' to also replace double functions at single precision",
+                   [](const char* argument) {
+                     if (strcmp(argument, "float") == 0) {
+                       s_write_c_options.native_math = NativeMath::Float;
+                     } else if (strcmp(argument, "all") == 0) {
+                       s_write_c_options.native_math = NativeMath::All;
+                     } else {
+                       fprintf(stderr, "--native-math must be 'float' or 'all'.\n");
+                       exit(1);
+                     }
+                   });
+  parser.AddOption("snapshot", "Run the start function at build time and emit the resulting memory, globals and table as the initial state",
+                   []() { s_snapshot = true; });
+  parser.AddOption("snapshot-init", "EXPORT", "Also run the exported function EXPORT before taking the snapshot (implies --snapshot)",
+                   [](const char* argument) {
+                     s_snapshot = true;
+                     s_snapshot_init = argument;
+                   });
   parser.Parse(argc, argv);
 
-  // TODO(binji): currently wasm2c doesn't support any non-default feature
-  // flags.
+  if (s_write_c_options.data_file && s_write_c_options.out_filename.empty()) {
+    fprintf(stderr, "--data-file requires an output file (-o).\n");
+    exit(1);
+  }
+
+  if (s_write_c_options.lazy && s_write_c_options.out_filename.empty()) {
+    fprintf(stderr, "--lazy requires an output file (-o).\n");
+    exit(1);
+  }
+
+  // Bulk memory and tail calls are the only features supported on top of the
+  // defaults.
+  const bool bulk_memory = s_features.bulk_memory_enabled();
+  const bool tail_call = s_features.tail_call_enabled();
+  s_features.set_bulk_memory_enabled(false);
+  s_features.set_tail_call_enabled(false);
   bool any_non_default_feature = false;
 #define WABT_FEATURE(variable, flag, default_, help) \
   any_non_default_feature |= (s_features.variable##_enabled() != default_);
 #include "src/feature.def"
 #undef WABT_FEATURE
+  s_features.set_bulk_memory_enabled(bulk_memory);
+  s_features.set_tail_call_enabled(tail_call);
 
   if (any_non_default_feature) {
-    fprintf(stderr, "wasm2c currently support only default feature flags.\n");
+    fprintf(stderr, "wasm2brs currently supports only the default feature flags, --enable-bulk-memory and --enable-tail-call.\n");
     exit(1);
   }
 }
@@ -148,6 +229,12 @@ int ProgramMain(int argc, char** argv) {
         WABT_USE(dummy_result);
       }
 
+      Snapshot snapshot;
+      if (Succeeded(result) && s_snapshot) {
+        result = TakeSnapshot(*module, s_features, s_snapshot_init, &snapshot, &errors);
+        s_write_c_options.snapshot = &snapshot;
+      }
+
       if (Succeeded(result)) {
         if (s_write_c_options.name_prefix.empty()) {
           if (module->name.empty()) {
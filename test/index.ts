@@ -78,6 +78,23 @@ const testWasmBrs = path.join(projectSource, "test-wasm.out.brs");
 const testSuiteDir = path.join(root, "third_party/testsuite");
 const wasm2brs = path.join(root, "build/wasm2brs/wasm2brs");
 
+// The proposal tests that wasm2brs supports and the feature each needs. The
+// rest of those directories are copies of the core tests or use the table
+// operations (table.init, table.copy, elem.drop), which are not supported.
+const proposalTests: Record<string, string> = {
+  "proposals/bulk-memory-operations/memory_copy.wast": "--enable-bulk-memory",
+  "proposals/bulk-memory-operations/memory_fill.wast": "--enable-bulk-memory",
+  "proposals/bulk-memory-operations/memory_init.wast": "--enable-bulk-memory",
+  "proposals/tail-call/return_call.wast": "--enable-tail-call",
+  "proposals/tail-call/return_call_indirect.wast": "--enable-tail-call"
+};
+
+const getFeatureFlags = (wastFile: string): string[] => {
+  const relative = path.relative(testSuiteDir, wastFile).split(path.sep).join("/");
+  const flag = proposalTests[relative];
+  return flag ? [flag] : [];
+};
+
 const outputWastTests = async (wastFile: string, guid: string): Promise<boolean | string> => {
   const testWast = path.resolve(wastFile);
   const testWastFilename = path.basename(wastFile);
@@ -94,9 +111,11 @@ const outputWastTests = async (wastFile: string, guid: string): Promise<boolean
 
   const outJsonFilename = "current.json";
   const outJson = path.join(runtestOut, outJsonFilename);
+  const featureFlags = getFeatureFlags(testWast);
   const wast2Json = await execa("third_party/wabt/bin/wast2json",
     [
       "--disable-multi-value",
+      ...featureFlags,
       testWast,
       "-o", outJson
     ],
@@ -206,6 +225,7 @@ const outputWastTests = async (wastFile: string, guid: string): Promise<boolean
     const wasm2BrsResult = await execa(wasm2brs,
       [
         "--name-prefix", moduleName,
+        ...featureFlags,
         path.join(runtestOut, test.module.filename)
       ],
       fromRootOptions);
@@ -361,7 +381,8 @@ const outputAndMaybeDeploy = async (wastFile: string, host?: string): Promise<bo
 
   if (args.wast === undefined) {
     const results: string[] = [];
-    for (const file of fs.readdirSync(testSuiteDir)) {
+    const wastFiles = fs.readdirSync(testSuiteDir).concat(Object.keys(proposalTests));
+    for (const file of wastFiles) {
       if (path.extname(file) === ".wast" && file !== "names.wast") {
         const result = await outputAndMaybeDeploy(path.join(testSuiteDir, file), host);
         if (typeof result === "string") {